@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <vulkan/vulkan.h>
+
+#include "buffer.h"
+#include "clock.h"
+#include "device.h"
+#include "output.h"
+#include "profiler.h"
+#include "telemetry.h"
+#include "vk_device.h"
+
+#define BENCH_PIPELINE_RUNS 5
+#define BENCH_BUFFER_RUNS 10
+#define BENCH_DEFAULT_SECONDS 5
+
+static int compare_int64(const void *a, const void *b)
+{
+  int64_t lhs = *(const int64_t *)a;
+  int64_t rhs = *(const int64_t *)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+static double usec(int64_t nsec)
+{
+  return (double)nsec / NSEC_PER_USEC;
+}
+
+// p50, p99 and max in microseconds
+static void write_stats(FILE *out, const char *name, int64_t *values, int count)
+{
+  fprintf(out, "    \"%s\": ", name);
+
+  if (count == 0) {
+    fprintf(out, "null");
+    return;
+  }
+
+  qsort(values, count, sizeof(values[0]), compare_int64);
+
+  fprintf(out, "{ \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f }",
+    usec(values[(count - 1) * 50 / 100]), usec(values[(count - 1) * 99 / 100]),
+    usec(values[count - 1]));
+}
+
+static bool bench_pipeline(struct vk_device *vk_dev, bool warm, int64_t *samples)
+{
+  for (int i = 0; i < BENCH_PIPELINE_RUNS; i++) {
+    VkPipelineCache cache = vk_dev->pipeline_cache;
+
+    // cold runs start from an empty cache every time
+    if (!warm) {
+      VkPipelineCacheCreateInfo info = {0};
+      info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+
+      if (vkCreatePipelineCache(vk_dev->device, &info, NULL, &cache) != VK_SUCCESS) {
+        return false;
+      }
+    }
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+
+    int64_t start = clock_now_nsec();
+    bool ok = vk_device_create_pipeline(vk_dev, cache, &pipeline);
+    samples[i] = clock_now_nsec() - start;
+
+    vkDestroyPipeline(vk_dev->device, pipeline, NULL);
+    if (!warm) {
+      vkDestroyPipelineCache(vk_dev->device, cache, NULL);
+    }
+
+    if (!ok) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool bench_buffers(struct output *output, int64_t *samples)
+{
+  const uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
+
+  for (int i = 0; i < BENCH_BUFFER_RUNS; i++) {
+    int64_t start = clock_now_nsec();
+
+    struct buffer *buffer = buffer_create(output->device, output->mode_info.hdisplay,
+      output->mode_info.vdisplay, DRM_FORMAT_XRGB8888, modifiers, 1);
+
+    samples[i] = clock_now_nsec() - start;
+
+    if (!buffer) {
+      return false;
+    }
+
+    buffer_destroy(buffer);
+  }
+
+  return true;
+}
+
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+  unsigned int tv_usec, void *user_data)
+{
+  (void)fd;
+  (void)sequence;
+
+  struct output *output = user_data;
+
+  int64_t flip_nsec = output->device->monotonic_timestamps ?
+    tv_sec * NSEC_PER_SEC + tv_usec * NSEC_PER_USEC : clock_now_nsec();
+
+  output_page_flip(output, flip_nsec);
+
+  // keep every frame a full redraw so the numbers measure the worst case
+  output_damage_whole(output);
+}
+
+// drives every output as fast as the display allows for the given time
+static bool bench_frames(struct device *device, int seconds)
+{
+  drmEventContext event_context = {0};
+  event_context.version = DRM_EVENT_CONTEXT_VERSION;
+  event_context.page_flip_handler = page_flip_handler;
+
+  int num_fds = 1 + device->num_outputs;
+  struct pollfd *fds = calloc(num_fds, sizeof(*fds));
+  if (!fds) {
+    return false;
+  }
+
+  fds[0].fd = device->kms_fd;
+  fds[0].events = POLLIN;
+
+  for (int i = 0; i < device->num_outputs; i++) {
+    fds[1 + i].fd = device->outputs[i]->scheduler.timer_fd;
+    fds[1 + i].events = POLLIN;
+
+    output_damage_whole(device->outputs[i]);
+    output_repaint(device->outputs[i]);
+  }
+
+  int64_t end = clock_now_nsec() + seconds * NSEC_PER_SEC;
+
+  while (clock_now_nsec() < end) {
+    int ret = poll(fds, num_fds, 100);
+    if (ret < 0 && errno != EINTR) {
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      free(fds);
+      return false;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      drmHandleEvent(device->kms_fd, &event_context);
+    }
+
+    for (int i = 0; i < device->num_outputs; i++) {
+      if (fds[1 + i].revents & POLLIN) {
+        struct output *output = device->outputs[i];
+        scheduler_ack(&output->scheduler);
+
+        if (!output->flip_pending) {
+          output_repaint(output);
+        }
+      }
+    }
+  }
+
+  // let the last flips land so nothing is in flight on exit
+  while (true) {
+    bool pending = false;
+    for (int i = 0; i < device->num_outputs; i++) {
+      pending |= device->outputs[i]->flip_pending;
+    }
+
+    if (!pending || poll(fds, 1, 1000) <= 0) {
+      break;
+    }
+
+    drmHandleEvent(device->kms_fd, &event_context);
+  }
+
+  free(fds);
+  return true;
+}
+
+static void write_output_results(FILE *out, struct output *output, int seconds)
+{
+  struct frame_timings frames[TELEMETRY_RING_SIZE];
+  int64_t values[TELEMETRY_RING_SIZE];
+
+  int n = telemetry_copy_frames(&output->telemetry, frames);
+  uint64_t total = atomic_load(&output->telemetry.frames);
+
+  fprintf(out, "  {\n");
+  fprintf(out, "    \"connector\": %u,\n", output->connector_id);
+  fprintf(out, "    \"mode\": \"%ux%u\",\n", output->mode_info.hdisplay,
+    output->mode_info.vdisplay);
+  fprintf(out, "    \"refresh_nsec\": %lld,\n", (long long)output->refresh_nsec);
+  fprintf(out, "    \"frames\": %llu,\n", (unsigned long long)total);
+  fprintf(out, "    \"fps\": %.2f,\n", (double)total / seconds);
+  fprintf(out, "    \"missed_vblanks\": %llu,\n",
+    (unsigned long long)atomic_load(&output->telemetry.missed_vblanks));
+
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    if (frames[i].commit_nsec && frames[i].flip_nsec) {
+      values[count++] = frames[i].flip_nsec - frames[i].commit_nsec;
+    }
+  }
+  write_stats(out, "commit_to_flip_usec", values, count);
+  fprintf(out, ",\n");
+
+  // the fence export and damage blob as well as the commit itself
+  count = 0;
+  for (int i = 0; i < n; i++) {
+    if (frames[i].commit_nsec && frames[i].submit_nsec) {
+      values[count++] = frames[i].commit_nsec - frames[i].submit_nsec;
+    }
+  }
+  write_stats(out, "submit_to_commit_usec", values, count);
+  fprintf(out, ",\n");
+
+  count = 0;
+  for (int i = 1; i < n; i++) {
+    if (frames[i].flip_nsec && frames[i - 1].flip_nsec) {
+      values[count++] = frames[i].flip_nsec - frames[i - 1].flip_nsec;
+    }
+  }
+  write_stats(out, "frame_time_usec", values, count);
+  fprintf(out, "\n  }");
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [--driver NAME] [--seconds N] [--output FILE]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  const char *driver = "vkms";
+  const char *output_path = NULL;
+  int seconds = BENCH_DEFAULT_SECONDS;
+
+  static const struct option options[] = {
+    { "driver", required_argument, NULL, 'd' },
+    { "seconds", required_argument, NULL, 's' },
+    { "output", required_argument, NULL, 'o' },
+    { "help", no_argument, NULL, 'h' },
+    { 0 },
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "d:s:o:h", options, NULL)) != -1) {
+    switch (opt) {
+      case 'd':
+        // "any" takes whatever device is there, real hardware included
+        driver = strcmp(optarg, "any") == 0 ? NULL : optarg;
+        break;
+      case 's':
+        seconds = atoi(optarg);
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (seconds <= 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  profiler_init();
+
+  int64_t start = clock_now_nsec();
+  struct device *device = device_create(driver);
+  int64_t bring_up_nsec = clock_now_nsec() - start;
+
+  if (!device) {
+    fprintf(stderr, "No usable %s device\n", driver ? driver : "KMS");
+    return EXIT_FAILURE;
+  }
+
+  profiler_report();
+
+  int64_t cold[BENCH_PIPELINE_RUNS];
+  int64_t warm[BENCH_PIPELINE_RUNS];
+  int64_t buffers[BENCH_BUFFER_RUNS];
+
+  if (!bench_pipeline(device->vk_device, false, cold) ||
+    !bench_pipeline(device->vk_device, true, warm))
+  {
+    fprintf(stderr, "Pipeline benchmark failed\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!bench_buffers(device->outputs[0], buffers)) {
+    fprintf(stderr, "Buffer benchmark failed\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!bench_frames(device, seconds)) {
+    fprintf(stderr, "Frame benchmark failed\n");
+    return EXIT_FAILURE;
+  }
+
+  FILE *out = stdout;
+  if (output_path) {
+    out = fopen(output_path, "w");
+    if (!out) {
+      fprintf(stderr, "Couldn't open %s: %s\n", output_path, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"driver\": \"%s\",\n", driver ? driver : "any");
+  fprintf(out, "  \"bring_up_usec\": %.1f,\n", usec(bring_up_nsec));
+  fprintf(out, "  \"runs\": {\n");
+  write_stats(out, "pipeline_cold_usec", cold, BENCH_PIPELINE_RUNS);
+  fprintf(out, ",\n");
+  write_stats(out, "pipeline_warm_usec", warm, BENCH_PIPELINE_RUNS);
+  fprintf(out, ",\n");
+  write_stats(out, "buffer_create_usec", buffers, BENCH_BUFFER_RUNS);
+  fprintf(out, "\n  },\n");
+  fprintf(out, "  \"seconds\": %d,\n", seconds);
+  fprintf(out, "  \"outputs\": [\n");
+
+  for (int i = 0; i < device->num_outputs; i++) {
+    write_output_results(out, device->outputs[i], seconds);
+    fprintf(out, i + 1 < device->num_outputs ? ",\n" : "\n");
+  }
+
+  fprintf(out, "  ]\n}\n");
+
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  return EXIT_SUCCESS;
+}
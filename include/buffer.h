@@ -0,0 +1,105 @@
+#ifndef BUFFER_H_
+#define BUFFER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gbm.h>
+#include <vulkan/vulkan.h>
+
+#include "damage.h"
+
+#define BUFFER_MAX_PLANES 4
+
+struct device;
+struct vk_device;
+
+struct dmabuf_attributes {
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  uint64_t modifier;
+
+  int num_planes;
+  int fds[BUFFER_MAX_PLANES];
+  uint32_t offsets[BUFFER_MAX_PLANES];
+  uint32_t strides[BUFFER_MAX_PLANES];
+};
+
+struct buffer {
+  struct device *device;
+  struct gbm_bo *bo;
+  struct dmabuf_attributes dmabuf;
+
+  uint32_t fb_id;
+  // GEM handles of an imported client dmabuf, the bo owns them otherwise
+  uint32_t handles[BUFFER_MAX_PLANES];
+
+  // frames since the buffer was last queued, 0 while its contents are undefined
+  int age;
+
+  // client buffers are only imported into Vulkan once they are composited
+  bool vk_import_failed;
+  VkImage image;
+  VkDeviceMemory memory;
+  VkImageView image_view;
+  // UNORM view of the image for the compute compositor
+  VkImageView storage_view;
+  VkFramebuffer framebuffer;
+  VkCommandBuffer command_buffer;
+  // copies layers into the frame on the compute queue after command_buffer
+  VkCommandBuffer compose_command_buffer;
+  // signalled by command_buffer when compose_command_buffer waits on it
+  VkSemaphore rendered_semaphore;
+
+  // what command_buffer was last recorded for, a frame matching all of it is
+  // submitted again as is
+  bool recorded;
+  bool recorded_initial;
+  uint32_t recorded_scene;
+  uint32_t recorded_layers;
+  uint32_t recorded_uniforms;
+  uint32_t recorded_instances;
+  struct damage recorded_damage;
+
+  // signalled when the last submission rendering into this buffer retires
+  VkFence fence;
+  // exported as the plane IN_FENCE_FD of the commit presenting this buffer
+  VkSemaphore render_semaphore;
+  // imported from release_fence_fd before rendering into this buffer again
+  VkSemaphore release_semaphore;
+  // OUT_FENCE_PTR of the commit that replaced this buffer on screen
+  int release_fence_fd;
+};
+
+struct buffer *buffer_create(struct device *device, uint32_t width, uint32_t height,
+  uint32_t format, const uint64_t *modifiers, int num_modifiers);
+
+// wraps a dmabuf handed over by a producer, owning its fds on success. A
+// KMS framebuffer is added when the driver takes the format and modifier,
+// fb_id stays 0 otherwise and the buffer can only be composited.
+struct buffer *buffer_import(struct device *device, const struct dmabuf_attributes *dmabuf);
+
+// the buffer's Vulkan image, imported on first use. False when the render
+// device can't import it.
+bool buffer_import_image(struct buffer *buffer);
+
+// client buffers must not be destroyed while on screen
+void buffer_destroy(struct buffer *buffer);
+
+// usage and flags of every image a buffer is imported as
+VkImageUsageFlags buffer_image_usage(struct vk_device *vk_dev);
+
+VkImageCreateFlags buffer_image_flags(struct vk_device *vk_dev);
+
+// the Vulkan format rendering into a DRM format, VK_FORMAT_UNDEFINED when
+// there is none
+VkFormat vk_format_from_drm(uint32_t drm_format);
+
+// the UNORM format of the same channel order the compute compositor views it
+// through, VK_FORMAT_UNDEFINED when there is none
+VkFormat vk_storage_format_from_drm(uint32_t drm_format);
+
+// true once the GPU has finished the last frame rendered into the buffer
+bool buffer_is_idle(struct buffer *buffer);
+
+#endif  // BUFFER_H_
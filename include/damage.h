@@ -0,0 +1,37 @@
+#ifndef DAMAGE_H_
+#define DAMAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// past this many rectangles damage collapses into its bounding box, which
+// keeps scissored draws and the FB_DAMAGE_CLIPS blob small
+#define DAMAGE_MAX_RECTS 16
+
+// same layout as struct drm_mode_rect, so it can go into FB_DAMAGE_CLIPS as is
+struct damage_rect {
+  int32_t x1;
+  int32_t y1;
+  int32_t x2;
+  int32_t y2;
+};
+
+struct damage {
+  struct damage_rect rects[DAMAGE_MAX_RECTS];
+  int num_rects;
+};
+
+void damage_clear(struct damage *damage);
+
+bool damage_is_empty(const struct damage *damage);
+
+void damage_add_rect(struct damage *damage, int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+
+void damage_add(struct damage *damage, const struct damage *other);
+
+// drops whatever lies outside a width by height surface
+void damage_clip(struct damage *damage, uint32_t width, uint32_t height);
+
+struct damage_rect damage_extents(const struct damage *damage);
+
+#endif  // DAMAGE_H_
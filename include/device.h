@@ -12,15 +12,53 @@ struct device {
   drmModePlanePtr *planes;
   int num_planes;
 
+  // parallel to planes, res->crtcs and res->connectors
+  struct plane_props *plane_props;
+  struct crtc_props *crtc_props;
+  struct connector_props *connector_props;
+
+  // modifiers negotiated per plane and format
+  struct modifier_set *modifier_sets;
+  int num_modifier_sets;
+
   struct output **outputs;
   int num_outputs;
 
+  // unplugged, with their disable commit still in flight. Their CRTC and
+  // planes stay claimed until it lands.
+  struct output **removed_outputs;
+  int num_removed_outputs;
+
   bool fb_modifiers;
+  bool monotonic_timestamps;
 
   struct gbm_device *gbm_device;
+  struct vk_probe *vk_probe;
   struct vk_device *vk_device;
 };
 
-struct device* device_create();
+// opens the first usable KMS device, driven by the named kernel driver
+// (e.g. "vkms") when driver isn't NULL
+struct device* device_create(const char *driver);
+
+// re-reads the connection state of one connector, or of every connector when
+// connector_id is 0, and removes the outputs of disconnected ones. Other
+// outputs are left running. Newly connected connectors without an output are
+// written to connected, which has room for every connector, to be probed and
+// passed to device_add_output. True when outputs were removed.
+bool device_hotplug(struct device *device, uint32_t connector_id, uint32_t *connected,
+  int *num_connected);
+
+// adds an output for a connector probed with drmModeGetConnector, true when
+// it was added
+bool device_add_output(struct device *device, drmModeConnectorPtr connector);
+
+// drops an output device_hotplug removed, once nothing of it is left on
+// screen, and destroys it
+void device_destroy_removed_output(struct device *device, struct output *output);
+
+// forgets the TEST_ONLY results of every output, once CRTCs came or went
+// or changed modes
+void device_invalidate_plane_caches(struct device *device);
 
 #endif  // DEVICE_H_
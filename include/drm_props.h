@@ -0,0 +1,99 @@
+#ifndef DRM_PROPS_H_
+#define DRM_PROPS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct device;
+
+enum plane_prop {
+  PLANE_PROP_TYPE,
+  PLANE_PROP_FB_ID,
+  PLANE_PROP_CRTC_ID,
+  PLANE_PROP_SRC_X,
+  PLANE_PROP_SRC_Y,
+  PLANE_PROP_SRC_W,
+  PLANE_PROP_SRC_H,
+  PLANE_PROP_CRTC_X,
+  PLANE_PROP_CRTC_Y,
+  PLANE_PROP_CRTC_W,
+  PLANE_PROP_CRTC_H,
+  PLANE_PROP_IN_FENCE_FD,
+  PLANE_PROP_ZPOS,
+  PLANE_PROP_IN_FORMATS,
+  PLANE_PROP_FB_DAMAGE_CLIPS,
+  PLANE_PROP_COUNT
+};
+
+enum crtc_prop {
+  CRTC_PROP_ACTIVE,
+  CRTC_PROP_MODE_ID,
+  CRTC_PROP_OUT_FENCE_PTR,
+  CRTC_PROP_VRR_ENABLED,
+  CRTC_PROP_COUNT
+};
+
+enum connector_prop {
+  CONNECTOR_PROP_CRTC_ID,
+  CONNECTOR_PROP_VRR_CAPABLE,
+  CONNECTOR_PROP_COUNT
+};
+
+// property ids are 0 when the driver doesn't expose the property, values
+// are a snapshot from when the device was opened
+struct plane_props {
+  uint32_t plane_id;
+  uint32_t ids[PLANE_PROP_COUNT];
+  uint64_t values[PLANE_PROP_COUNT];
+
+  uint64_t zpos_min;
+  uint64_t zpos_max;
+  bool zpos_mutable;
+};
+
+struct crtc_props {
+  uint32_t crtc_id;
+  uint32_t ids[CRTC_PROP_COUNT];
+  uint64_t values[CRTC_PROP_COUNT];
+};
+
+struct connector_props {
+  uint32_t connector_id;
+  uint32_t ids[CONNECTOR_PROP_COUNT];
+  uint64_t values[CONNECTOR_PROP_COUNT];
+};
+
+struct format_modifier {
+  uint32_t format;
+  uint64_t modifier;
+};
+
+// resolves the properties of every plane, CRTC and connector once, so
+// building a commit never has to ask the kernel for property ids
+bool drm_props_init(struct device *device);
+
+void drm_props_finish(struct device *device);
+
+const struct plane_props *drm_plane_props(struct device *device, uint32_t plane_id);
+
+const struct crtc_props *drm_crtc_props(struct device *device, uint32_t crtc_id);
+
+const struct connector_props *drm_connector_props(struct device *device, uint32_t connector_id);
+
+// true when the plane has every property a commit showing a buffer on it sets
+bool drm_plane_props_usable(const struct plane_props *props);
+
+// true when the CRTC has every property a commit on it sets
+bool drm_crtc_props_usable(const struct crtc_props *props);
+
+// one of DRM_PLANE_TYPE_*, or -1 when the plane has no type property
+int drm_get_plane_type(struct device *device, uint32_t plane_id);
+
+bool drm_is_primary_plane(struct device *device, uint32_t plane_id);
+
+// format/modifier pairs the plane can scan out, from its IN_FORMATS blob or,
+// without one, its legacy format list with the linear modifier
+int drm_get_plane_formats(struct device *device, uint32_t plane_id,
+  struct format_modifier **formats);
+
+#endif  // DRM_PROPS_H_
@@ -0,0 +1,10 @@
+#ifndef FENCE_H_
+#define FENCE_H_
+
+#include <stdint.h>
+
+// CLOCK_MONOTONIC time the sync_file signalled at, 0 if it hasn't yet or
+// the driver doesn't report it
+int64_t fence_signal_nsec(int fd);
+
+#endif  // FENCE_H_
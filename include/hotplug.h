@@ -0,0 +1,44 @@
+#ifndef HOTPLUG_H_
+#define HOTPLUG_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct device;
+struct udev;
+struct udev_monitor;
+
+// listens for the kernel's connector hotplug uevents of one KMS device
+struct hotplug {
+  struct udev *udev;
+  struct udev_monitor *monitor;
+
+  // device number of the KMS node, events of other cards are ignored
+  dev_t devnum;
+  int kms_fd;
+
+  // new connectors are probed on a worker, reading their EDID can take long
+  // enough to stall every running output
+  pthread_t thread;
+  bool threaded;
+  // connector ids to the worker, drmModeConnectorPtr back
+  int request_fds[2];
+  int result_fds[2];
+
+  // readable when either the monitor or a probe result is
+  int epoll_fd;
+};
+
+bool hotplug_init(struct hotplug *hotplug, struct device *device);
+
+void hotplug_finish(struct hotplug *hotplug);
+
+// readable when events or probed connectors are queued, -1 without a monitor
+int hotplug_fd(struct hotplug *hotplug);
+
+// handles every queued event and probed connector, true when outputs were
+// added or removed
+bool hotplug_dispatch(struct hotplug *hotplug, struct device *device);
+
+#endif  // HOTPLUG_H_
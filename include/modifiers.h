@@ -0,0 +1,25 @@
+#ifndef MODIFIERS_H_
+#define MODIFIERS_H_
+
+#include <stdint.h>
+
+struct device;
+
+// the tiled or compressed modifiers a plane can scan out a format with and
+// the render device can render to and import from a dmabuf, linear excluded
+struct modifier_set {
+  uint32_t plane_id;
+  uint32_t format;
+  uint64_t *modifiers;
+  int num_modifiers;
+};
+
+// negotiated once per plane and format, later calls return the cached set.
+// the set is left for gbm to pick the best layout from, and is empty when
+// only linear is shared
+int modifiers_get(struct device *device, uint32_t plane_id, uint32_t format,
+  const uint64_t **modifiers);
+
+void modifiers_finish(struct device *device);
+
+#endif  // MODIFIERS_H_
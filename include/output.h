@@ -1,22 +1,83 @@
 #ifndef OUTPUT_H_
 #define OUTPUT_H_
 
+#include <stdbool.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "damage.h"
+#include "drm_props.h"
+#include "plane_allocator.h"
+#include "scene.h"
+#include "scheduler.h"
+#include "telemetry.h"
+
 struct device;
+struct swapchain;
 
 struct output {
   struct device *device;
   uint32_t primary_plane_id;
   uint32_t crtc_id;
   uint32_t connector_id;
-  drmModeModeInfoPtr mode_info;
+  drmModeModeInfo mode_info;
   int64_t refresh_nsec;
+
+  const struct plane_props *primary_plane_props;
+  const struct crtc_props *crtc_props;
+  const struct connector_props *connector_props;
+
+  // mode and routing the first commit pins the CRTC to, 0 once it has gone
+  // out. Only a hotplugged output, or a takeover the driver refused as a
+  // plain flip, needs a modeset for it.
+  uint32_t mode_blob_id;
+  bool modeset;
+
+  // the panel refreshes when a frame arrives, at most every refresh_nsec
+  bool vrr;
+
+  // layers shown on top of the output's own rendering
+  struct scene scene;
+  struct plane_allocator planes;
+
+  bool flip_pending;
+  // unplugged, switched off once no flip is in flight and freed once that
+  // has landed
+  bool removed;
+  bool disabled;
+
+  // changed on screen since the last frame was queued
+  struct damage damage;
+
+  struct scheduler scheduler;
+  // timestamps of the frame in flight
+  struct frame_timings frame;
+  struct telemetry telemetry;
+  // render fence of the frame in flight, kept to measure its GPU time
+  int render_fence_fd;
+
+  struct swapchain *swapchain;
 };
 
+// takes over the CRTC already lighting up the connector
 struct output *output_create(struct device *device, drmModeConnectorPtr connector);
 
+// drives a connector nothing lights up yet, on a CRTC no output uses, in its
+// preferred mode. The modeset goes out with the first frame.
+struct output *output_create_modeset(struct device *device, drmModeConnectorPtr connector);
+
+// checks that the first frame can go out on the mode and routing the firmware
+// left behind as a plain flip, and falls back to a modeset with that same mode
+// when the driver disagrees. Needs the swapchain.
+void output_takeover(struct output *output);
+
+void output_destroy(struct output *output);
+
+// switches the output off and frees it from the flip events, never waiting
+// on KMS. The device must list it among its removed outputs rather than its
+// running ones.
+void output_remove(struct output *output);
+
 struct output* output_new(
   struct device *device,
   uint32_t primary_plane_id,
@@ -26,4 +87,15 @@ struct output* output_new(
   int64_t refresh_nsec
 );
 
+// marks a region as changed, and wakes the output if it went idle. Needed
+// after anything the output shows changes, scene layers included.
+void output_damage(struct output *output, int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+
+void output_damage_whole(struct output *output);
+
+// renders and queues a frame if anything was damaged, idles otherwise
+bool output_repaint(struct output *output);
+
+void output_page_flip(struct output *output, int64_t flip_nsec);
+
 #endif  // OUTPUT_H_
@@ -0,0 +1,15 @@
+#ifndef PIPELINE_CACHE_H_
+#define PIPELINE_CACHE_H_
+
+#include <stdbool.h>
+
+struct vk_device;
+
+// creates vk_device->pipeline_cache, seeded from disk when the stored
+// cache was written by the same driver for the same device
+bool pipeline_cache_load(struct vk_device *vk_dev);
+
+// writes the cache back if pipeline creation added to it
+void pipeline_cache_store(struct vk_device *vk_dev);
+
+#endif  // PIPELINE_CACHE_H_
@@ -0,0 +1,78 @@
+#ifndef PLANE_ALLOCATOR_H_
+#define PLANE_ALLOCATOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "drm_props.h"
+#include "plane_cache.h"
+
+#define PLANE_ALLOCATOR_MAX_OVERLAYS 8
+
+struct output;
+struct scene;
+
+struct overlay_plane {
+  uint32_t plane_id;
+  const struct plane_props *props;
+
+  struct format_modifier *formats;
+  int num_formats;
+
+  uint64_t zpos;
+  uint64_t zpos_min;
+  uint64_t zpos_max;
+  bool zpos_mutable;
+
+  // showing a layer in the pending request / on screen
+  bool pending;
+  bool enabled;
+};
+
+struct plane_allocator {
+  struct output *output;
+
+  // zpos of the primary plane, every overlay must stack above it
+  uint64_t primary_zpos;
+
+  // highest zpos first
+  struct overlay_plane overlays[PLANE_ALLOCATOR_MAX_OVERLAYS];
+  int num_overlays;
+
+  // configuration of the primary plane in the request being built, every
+  // TEST_ONLY result is cached under a key starting from it
+  uint64_t primary_key;
+  struct plane_cache cache;
+};
+
+// claims the overlay planes usable on the output's CRTC which no other
+// output has claimed yet
+bool plane_allocator_init(struct plane_allocator *allocator, struct output *output);
+
+void plane_allocator_finish(struct plane_allocator *allocator);
+
+bool plane_allocator_owns(struct plane_allocator *allocator, uint32_t plane_id);
+
+// assigns scene layers from bottom up to overlays top down, adding their
+// state to req. req must already hold the primary plane state so each
+// candidate can be checked with a TEST_ONLY commit. Returns the number of
+// those layers left for the GPU to composite, which are always the bottom ones.
+int plane_allocator_assign(struct plane_allocator *allocator, drmModeAtomicReqPtr req,
+  struct scene *scene, int bottom);
+
+// checks req holding nothing but the primary plane with a TEST_ONLY commit,
+// or with the cache when the same configuration was checked before
+bool plane_allocator_test_primary(struct plane_allocator *allocator, drmModeAtomicReqPtr req);
+
+// forgets every cached TEST_ONLY result, needed once a modeset or hotplug
+// changes what the hardware can take
+void plane_allocator_invalidate(struct plane_allocator *allocator);
+
+// the request from the last plane_allocator_assign was committed
+void plane_allocator_commit(struct plane_allocator *allocator);
+
+// adds switching off every overlay on screen to req, ahead of the CRTC going off
+void plane_allocator_clear(struct plane_allocator *allocator, drmModeAtomicReqPtr req);
+
+#endif  // PLANE_ALLOCATOR_H_
@@ -0,0 +1,69 @@
+#ifndef PLANE_CACHE_H_
+#define PLANE_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// a power of two, colliding configurations evict each other
+#define PLANE_CACHE_SIZE 256
+
+// key of a configuration without any planes, before the first one is added
+#define PLANE_CACHE_SEED 0xcbf29ce484222325ULL
+
+struct buffer;
+
+// everything about one plane a TEST_ONLY commit can depend on
+struct plane_cache_plane {
+  uint32_t plane_id;
+  uint32_t crtc_id;
+  uint32_t format;
+  uint32_t stride;
+  uint64_t modifier;
+  uint32_t fb_width;
+  uint32_t fb_height;
+
+  uint32_t src_x;
+  uint32_t src_y;
+  uint32_t src_w;
+  uint32_t src_h;
+  int32_t crtc_x;
+  int32_t crtc_y;
+  uint32_t crtc_w;
+  uint32_t crtc_h;
+
+  uint64_t zpos;
+};
+
+struct plane_cache_entry {
+  // 0 for an empty slot
+  uint64_t key;
+  bool valid;
+};
+
+struct plane_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct plane_cache {
+  struct plane_cache_entry entries[PLANE_CACHE_SIZE];
+  struct plane_cache_stats stats;
+};
+
+void plane_cache_clear(struct plane_cache *cache);
+
+// starts the description of a plane showing buffer, the caller fills in
+// the rectangles and zpos
+void plane_cache_plane_init(struct plane_cache_plane *plane, uint32_t plane_id,
+  uint32_t crtc_id, struct buffer *buffer);
+
+// key of the configuration key with plane added on top. Planes have to be
+// added in the same order each time for a configuration to match.
+uint64_t plane_cache_key(uint64_t key, const struct plane_cache_plane *plane);
+
+// true when the configuration was checked before, with its result in valid
+bool plane_cache_lookup(struct plane_cache *cache, uint64_t key, bool *valid);
+
+void plane_cache_insert(struct plane_cache *cache, uint64_t key, bool valid);
+
+#endif  // PLANE_CACHE_H_
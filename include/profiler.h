@@ -0,0 +1,23 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#define PROFILER_MAX_STAGES 64
+
+// records how long each startup stage took and on which thread, to see
+// where time to first frame goes. Safe to use from worker threads.
+
+// marks time zero, call first thing in main
+void profiler_init(void);
+
+// returns a handle for profiler_end, or -1 once all stages are used up
+int profiler_begin(const char *name);
+
+void profiler_end(int stage);
+
+// a stage without duration, such as the first flip
+void profiler_mark(const char *name);
+
+// prints every stage recorded so far
+void profiler_report(void);
+
+#endif  // PROFILER_H_
@@ -0,0 +1,64 @@
+#ifndef QUADS_H_
+#define QUADS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+// one instance of the quad renderer, laid out as the std430 Quad of shader.vert
+struct quad_instance {
+  // x, y, width and height in output pixels
+  float rect[4];
+  // source rectangle in normalised texture coordinates
+  float uv[4];
+  float color[4];
+  // higher layers draw over lower ones, within a layer quads are reordered
+  // into as few draws as possible
+  uint32_t layer;
+  uint32_t padding[3];
+};
+
+struct quad {
+  struct quad_instance instance;
+  // VK_NULL_HANDLE draws with the device's own pipeline
+  VkPipeline pipeline;
+  // insertion order, keeps the quads of a batch in painter's order
+  uint32_t seq;
+};
+
+// consecutive quads drawn by one instanced draw
+struct quad_batch {
+  VkPipeline pipeline;
+  uint32_t first;
+  uint32_t count;
+};
+
+struct quad_list {
+  struct quad *quads;
+  int num_quads;
+  int max_quads;
+  uint32_t next_seq;
+
+  // valid while sorted is set, adding a quad clears it
+  struct quad_batch *batches;
+  int num_batches;
+  bool sorted;
+};
+
+void quads_init(struct quad_list *list);
+
+void quads_finish(struct quad_list *list);
+
+void quads_clear(struct quad_list *list);
+
+// the instance to fill in, valid until the next quad is added
+struct quad_instance *quads_add(struct quad_list *list, VkPipeline pipeline, uint32_t layer);
+
+// orders the quads by layer and pipeline and splits them into batches, a
+// no-op until more quads are added
+void quads_sort(struct quad_list *list);
+
+// copies the instances, in batch order, to dst which holds num_quads of them
+void quads_write(const struct quad_list *list, struct quad_instance *dst);
+
+#endif  // QUADS_H_
@@ -0,0 +1,16 @@
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include <stdbool.h>
+
+struct buffer;
+struct damage;
+struct output;
+
+// redraws the damaged part of the buffer. render_fence_fd is set to a
+// sync_file fd signalled when the frame is rendered, or to -1 when it already
+// has been.
+bool render_frame(struct output *output, struct buffer *buffer, const struct damage *damage,
+  int *render_fence_fd);
+
+#endif  // RENDER_H_
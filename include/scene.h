@@ -0,0 +1,60 @@
+#ifndef SCENE_H_
+#define SCENE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "quads.h"
+
+#define SCENE_MAX_LAYERS 8
+
+struct buffer;
+
+struct layer {
+  struct buffer *buffer;
+
+  // region of the buffer to show, in buffer pixels
+  uint32_t src_x;
+  uint32_t src_y;
+  uint32_t src_w;
+  uint32_t src_h;
+
+  // where it lands on the output, scaled when it differs from the source
+  int32_t x;
+  int32_t y;
+  uint32_t width;
+  uint32_t height;
+
+  // overlay plane the layer was given for the current frame, 0 when the
+  // GPU composites it into the primary plane instead
+  uint32_t plane_id;
+};
+
+// layers stacked on top of the output's own rendering, bottom first
+struct scene {
+  // the output's own rendering, drawn by the GPU before any layer
+  struct quad_list quads;
+
+  struct layer layers[SCENE_MAX_LAYERS];
+  int num_layers;
+
+  // bumped on every change, recorded frames are reused until it moves
+  uint32_t generation;
+};
+
+void scene_init(struct scene *scene);
+
+void scene_finish(struct scene *scene);
+
+// adds a layer on top showing the whole buffer at its own size
+struct layer *scene_add_layer(struct scene *scene, struct buffer *buffer, int32_t x, int32_t y);
+
+void scene_remove_layer(struct scene *scene, struct layer *layer);
+
+// adds a quad to the output's own rendering, see quads_add
+struct quad_instance *scene_add_quad(struct scene *scene, VkPipeline pipeline, uint32_t layer);
+
+// needed after changing a layer's fields directly
+void scene_changed(struct scene *scene);
+
+#endif  // SCENE_H_
@@ -0,0 +1,54 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// number of frames the render budget is the maximum of
+#define SCHEDULER_WINDOW 32
+
+// predicts the next vblank from flip timestamps and delays rendering
+// until just before it, keeping input-to-photon latency low
+struct scheduler {
+  // with variable refresh the shortest time between two flips, otherwise
+  // the fixed vblank period
+  int64_t refresh_nsec;
+  // the panel waits for each flip, so there is no vblank grid to line up with
+  bool vrr;
+
+  // timerfd firing when the next frame should start rendering
+  int timer_fd;
+
+  int64_t last_flip_nsec;
+  int64_t target_vblank_nsec;
+
+  int64_t samples[SCHEDULER_WINDOW];
+  int num_samples;
+  int next_sample;
+};
+
+bool scheduler_init(struct scheduler *scheduler, int64_t refresh_nsec);
+
+void scheduler_finish(struct scheduler *scheduler);
+
+void scheduler_set_vrr(struct scheduler *scheduler, bool vrr);
+
+// time rendering plus the safety margin is expected to take
+int64_t scheduler_budget(struct scheduler *scheduler);
+
+// record how long a frame took from render start to GPU completion
+void scheduler_add_sample(struct scheduler *scheduler, int64_t render_nsec);
+
+// record a flip event and arm the timer for the frame after it
+void scheduler_flip(struct scheduler *scheduler, int64_t flip_nsec);
+
+// arm the timer for the next predicted vblank, after the output went idle
+void scheduler_wake(struct scheduler *scheduler);
+
+// arm the timer one refresh period from now, after a frame couldn't be queued
+void scheduler_defer(struct scheduler *scheduler);
+
+// consume an expiry of timer_fd
+void scheduler_ack(struct scheduler *scheduler);
+
+#endif  // SCHEDULER_H_
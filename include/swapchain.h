@@ -0,0 +1,74 @@
+#ifndef SWAPCHAIN_H_
+#define SWAPCHAIN_H_
+
+#include "damage.h"
+#include "vk_device.h"
+#include "vk_memory.h"
+
+// transient uniforms and staging of one frame, a multiple of every uniform
+// offset alignment so each frame's slice starts on one
+#define SWAPCHAIN_ARENA_SIZE (1u << 20)
+
+// quad instances of one frame in device local memory, a whole number of them
+#define SWAPCHAIN_INSTANCES_SIZE (1u << 20)
+
+struct buffer;
+struct output;
+
+struct swapchain {
+  struct output *output;
+
+  struct buffer *buffers[BUFFER_QUEUE_DEPTH];
+  int num_buffers;
+
+  // one mapped buffer, sliced into an arena per swapchain buffer
+  VkBuffer uniform_buffer;
+  struct vk_allocation uniform_allocation;
+  // uploaded through the staging ring into a slice per swapchain buffer,
+  // VK_NULL_HANDLE without one, which leaves the instances in the arenas
+  VkBuffer instance_buffer;
+  struct vk_allocation instance_allocation;
+
+  // binds the whole uniform and instance buffers, draws pick their slice
+  // with a dynamic offset and their instances with firstInstance, so the set
+  // is written once and never again
+  VkDescriptorSet descriptor_set;
+  VkDeviceSize uniform_alignment;
+
+  // parallel to buffers, each recycled once its buffer is acquired again
+  struct vk_arena arenas[BUFFER_QUEUE_DEPTH];
+
+  // most recently committed, on screen or about to be
+  struct buffer *front;
+  // next buffer to hand out, oldest first
+  int next;
+
+  // damage of the most recently queued frames, newest first
+  struct damage history[BUFFER_QUEUE_DEPTH];
+};
+
+struct swapchain *swapchain_create(struct output *output);
+
+void swapchain_destroy(struct swapchain *swapchain);
+
+// hands out an idle buffer, with its arena reset
+struct buffer *swapchain_acquire(struct swapchain *swapchain);
+
+// position of buffer in the swapchain, -1 when it isn't one of its buffers
+int swapchain_index(struct swapchain *swapchain, struct buffer *buffer);
+
+// per-frame allocations for the frame rendered into buffer
+struct vk_arena *swapchain_arena(struct swapchain *swapchain, struct buffer *buffer);
+
+// region of the buffer to redraw for a frame damaging frame_damage, which
+// also covers whatever changed since the buffer was last on screen
+void swapchain_buffer_damage(struct swapchain *swapchain, struct buffer *buffer,
+  const struct damage *frame_damage, struct damage *buffer_damage);
+
+void swapchain_queue(struct swapchain *swapchain, struct buffer *buffer, int release_fence_fd,
+  const struct damage *frame_damage);
+
+// a frame went on screen without a swapchain buffer, releasing the front one
+void swapchain_bypass(struct swapchain *swapchain, int release_fence_fd);
+
+#endif  // SWAPCHAIN_H_
@@ -0,0 +1,78 @@
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// frames kept for rolling statistics, a power of two
+#define TELEMETRY_RING_SIZE 256
+// cumulative histograms, the last bucket collects everything beyond
+#define TELEMETRY_BUCKET_USEC 250
+#define TELEMETRY_NUM_BUCKETS 256
+
+struct device;
+
+// CLOCK_MONOTONIC timestamps of one frame, 0 when a stage didn't happen
+struct frame_timings {
+  int64_t start_nsec;
+  int64_t record_nsec;
+  int64_t submit_nsec;
+  int64_t gpu_done_nsec;
+  int64_t commit_nsec;
+  int64_t flip_nsec;
+};
+
+struct frame_record {
+  // 0 while the slot is being written, the frame number once it's complete
+  _Atomic uint64_t seq;
+  struct frame_timings timings;
+};
+
+struct histogram {
+  _Atomic uint64_t counts[TELEMETRY_NUM_BUCKETS];
+};
+
+// written by the thread driving the output only, readable from any thread
+// without locks: readers retry or skip slots overwritten while copying
+struct telemetry {
+  int64_t refresh_nsec;
+  // flips land whenever frames are ready, long intervals aren't misses
+  bool vrr;
+
+  struct frame_record ring[TELEMETRY_RING_SIZE];
+  _Atomic uint64_t frames;
+
+  _Atomic uint64_t missed_vblanks;
+  int64_t last_flip_nsec;
+
+  struct histogram frame_time;
+  struct histogram latency;
+};
+
+void telemetry_init(struct telemetry *telemetry, int64_t refresh_nsec);
+
+// the output stopped flipping until something changes, the gap until the
+// next flip isn't a frame time
+void telemetry_idle(struct telemetry *telemetry);
+
+// records a frame once its flip event arrived
+void telemetry_frame(struct telemetry *telemetry, const struct frame_timings *timings);
+
+// copies the frames in the rolling window, oldest first, into an array of
+// TELEMETRY_RING_SIZE entries and returns how many there were
+int telemetry_copy_frames(struct telemetry *telemetry, struct frame_timings *frames);
+
+// statistics of every output as a JSON document, to be freed by the caller
+char *telemetry_json(struct device *device, size_t *size);
+
+// unix socket at $XDG_RUNTIME_DIR/gfx-telemetry, returns -1 without one
+int telemetry_listen(void);
+
+// answers one client of the listening socket with telemetry_json
+void telemetry_serve(struct device *device, int listen_fd);
+
+void telemetry_close(int listen_fd);
+
+#endif  // TELEMETRY_H_
@@ -1,10 +1,38 @@
 #ifndef VK_DEVICE_H_
 #define VK_DEVICE_H_
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <vulkan/vulkan.h>
 
+#define BUFFER_QUEUE_DEPTH 3
+
 struct device;
+struct vk_memory;
+struct vk_staging;
+
+struct vk_physical_device_info {
+  VkPhysicalDevice physical_device;
+  VkPhysicalDeviceProperties props;
+
+  bool has_pci_bus_info;
+  VkPhysicalDevicePCIBusInfoPropertiesEXT pci_bus_info;
+
+  bool has_drm_props;
+  VkPhysicalDeviceDrmPropertiesEXT drm_props;
+};
+
+// instance creation and physical device enumeration need nothing from KMS,
+// so they run on a worker thread while the KMS device is being probed
+struct vk_probe {
+  pthread_t thread;
+  bool threaded;
+  bool done;
+
+  VkInstance instance;
+  struct vk_physical_device_info *devices;
+  uint32_t num_devices;
+};
 
 struct vk_device {
   VkInstance instance;
@@ -18,12 +46,81 @@ struct vk_device {
   VkPipelineLayout pipeline_layout;
   VkPipeline pipeline;
 
+  // sub-allocates everything but imported dmabufs
+  struct vk_memory *memory;
+
+  // uploads through the transfer queue, NULL when it couldn't be set up
+  struct vk_staging *staging;
+
+  VkPipelineCache pipeline_cache;
+  size_t pipeline_cache_size;
+
   uint32_t enabled_extensions_count;
   const char* const* enabled_extensions;
 
   uint32_t queue_family;
+
+  // dedicated families where the device has them, the graphics family otherwise
+  uint32_t compute_queue_family;
+  VkQueue compute_queue;
+  uint32_t transfer_queue_family;
+  VkQueue transfer_queue;
+
+  // layers the GPU composites are copied by a compute shader on the compute
+  // queue rather than blitted after the render pass, see GFX_COMPUTE_COMPOSITION
+  bool compute_composition;
+  VkCommandPool compute_command_pool;
+  VkSampler compose_sampler;
+  VkDescriptorSetLayout compose_set_layout;
+  VkPipelineLayout compose_layout;
+  VkPipeline compose_pipeline;
+
+  // rendering happens on a different device than the one scanning out, so
+  // buffers shared between the two have to be linear
+  bool prime;
+
+  PFN_vkGetMemoryFdPropertiesKHR get_memory_fd_properties;
+  PFN_vkGetSemaphoreFdKHR get_semaphore_fd;
+  PFN_vkImportSemaphoreFdKHR import_semaphore_fd;
+  PFN_vkCmdPushDescriptorSetKHR push_descriptor_set;
+};
+
+struct vk_probe *vk_probe_start(void);
+
+// waits for the worker, false when it found no physical device
+bool vk_probe_wait(struct vk_probe *probe);
+
+void vk_probe_destroy(struct vk_probe *probe);
+
+// the probe must outlive the device, which uses its instance
+struct vk_device *vk_device_create(struct device *device, struct vk_probe *probe);
+
+void vk_device_destroy(struct vk_device *device);
+
+// format the compute compositor writes frames through, as storage images
+// can't be sRGB. Layers are read through vk_storage_format_from_drm.
+#define VK_DEVICE_STORAGE_FORMAT VK_FORMAT_B8G8R8A8_UNORM
+
+// one descriptor set per swapchain, pointing at its uniform buffer
+#define VK_DEVICE_MAX_UNIFORM_SETS 16
+
+// uniforms of one draw, matching shader.vert
+struct vk_draw_uniforms {
+  float viewport[2];
+  float padding[2];
+};
+
+// push constants of the compute compositor, matching compose.comp
+struct vk_compose_blit {
+  int32_t dst_offset[2];
+  int32_t dst_extent[2];
+  float src_offset[2];
+  float src_extent[2];
 };
 
-struct vk_device *vk_device_create(struct device *device);
+// builds the render pipeline against the device's pipeline layout and
+// render pass, through the given cache, which may be VK_NULL_HANDLE
+bool vk_device_create_pipeline(struct vk_device *vk_dev, VkPipelineCache cache,
+  VkPipeline *pipeline);
 
 #endif  // VK_DEVICE_H_
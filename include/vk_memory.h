@@ -0,0 +1,131 @@
+#ifndef VK_MEMORY_H_
+#define VK_MEMORY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+// slot sizes grow by 4x from 4 KiB to 4 MiB, anything larger gets its own
+// allocation
+#define VK_MEMORY_MIN_SLOT_SIZE (4u << 10)
+#define VK_MEMORY_SIZE_CLASSES 6
+#define VK_MEMORY_BLOCK_SIZE (16u << 20)
+#define VK_MEMORY_MAX_SLOTS (VK_MEMORY_BLOCK_SIZE / VK_MEMORY_MIN_SLOT_SIZE)
+
+struct vk_device;
+
+// one vkAllocateMemory split into equally sized slots
+struct vk_memory_block {
+  struct vk_memory_block *next;
+
+  VkDeviceMemory memory;
+  // the whole block, mapped for as long as it lives when host visible
+  void *mapped;
+
+  uint32_t num_slots;
+  uint32_t num_used;
+  uint64_t used[VK_MEMORY_MAX_SLOTS / 64];
+};
+
+struct vk_allocation {
+  VkDeviceMemory memory;
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  // NULL unless the memory is host visible
+  void *mapped;
+
+  // NULL for allocations too large for a slot
+  struct vk_memory_block *block;
+  int size_class;
+  uint32_t memory_type;
+  uint32_t slot;
+};
+
+struct vk_memory_stats {
+  uint32_t blocks;
+  uint32_t dedicated;
+  uint32_t allocations;
+
+  // device memory held in blocks and dedicated allocations
+  VkDeviceSize reserved;
+  // handed out, rounded up to slot sizes
+  VkDeviceSize allocated;
+  // asked for, the gap to allocated is lost to rounding
+  VkDeviceSize requested;
+};
+
+struct vk_memory {
+  struct vk_device *vk_dev;
+
+  VkPhysicalDeviceMemoryProperties props;
+  VkDeviceSize buffer_image_granularity;
+
+  // per memory type and size class, blocks with free slots first
+  struct vk_memory_block *blocks[VK_MAX_MEMORY_TYPES][VK_MEMORY_SIZE_CLASSES];
+
+  struct vk_memory_stats stats;
+};
+
+// bump allocator over one host visible buffer, or a slice of one, reset
+// wholesale once the frame that used it has retired
+struct vk_arena {
+  struct vk_memory *memory;
+
+  VkBuffer buffer;
+  struct vk_allocation allocation;
+  // a slice of a buffer someone else owns and frees
+  bool borrowed;
+
+  // where the arena's slice of the buffer starts and how long it is
+  VkDeviceSize base;
+  VkDeviceSize size;
+
+  VkDeviceSize head;
+  // most used in a single frame since creation
+  VkDeviceSize high_water;
+};
+
+struct vk_memory *vk_memory_create(struct vk_device *vk_dev);
+
+// every allocation must have been freed
+void vk_memory_destroy(struct vk_memory *memory);
+
+// memory satisfying reqs with at least the given property flags
+bool vk_memory_alloc(struct vk_memory *memory, const VkMemoryRequirements *reqs,
+  VkMemoryPropertyFlags flags, struct vk_allocation *allocation);
+
+void vk_memory_free(struct vk_memory *memory, struct vk_allocation *allocation);
+
+// creates a buffer and binds sub-allocated memory to it
+bool vk_memory_create_buffer(struct vk_memory *memory, VkDeviceSize size,
+  VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, VkBuffer *buffer,
+  struct vk_allocation *allocation);
+
+// same, but used by each of the queue families without ownership transfers
+// when there is more than one
+bool vk_memory_create_shared_buffer(struct vk_memory *memory, VkDeviceSize size,
+  VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, const uint32_t *queue_families,
+  uint32_t num_queue_families, VkBuffer *buffer, struct vk_allocation *allocation);
+
+void vk_memory_destroy_buffer(struct vk_memory *memory, VkBuffer buffer,
+  struct vk_allocation *allocation);
+
+bool vk_arena_init(struct vk_arena *arena, struct vk_memory *memory, VkDeviceSize size,
+  VkBufferUsageFlags usage);
+
+// an arena over [base, base + size) of a buffer the caller keeps alive, base
+// aligned as strictly as anything allocated from it
+void vk_arena_init_slice(struct vk_arena *arena, VkBuffer buffer,
+  const struct vk_allocation *allocation, VkDeviceSize base, VkDeviceSize size);
+
+void vk_arena_finish(struct vk_arena *arena);
+
+// the GPU must be done with everything allocated since the last reset
+void vk_arena_reset(struct vk_arena *arena);
+
+// carves size bytes out of the arena's buffer, false once the frame's share
+// is used up. Offsets are from the start of the buffer, not of the slice.
+bool vk_arena_alloc(struct vk_arena *arena, VkDeviceSize size, VkDeviceSize alignment,
+  VkDeviceSize *offset, void **mapped);
+
+#endif  // VK_MEMORY_H_
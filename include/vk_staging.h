@@ -0,0 +1,99 @@
+#ifndef VK_STAGING_H_
+#define VK_STAGING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "vk_memory.h"
+
+#define VK_STAGING_RING_SIZE (8u << 20)
+// batches in flight at once, enough for a frame queued on every buffer of a
+// few outputs and one being filled
+#define VK_STAGING_BATCHES 16
+
+struct vk_device;
+
+struct vk_staging_copy {
+  VkBuffer buffer;
+  VkBufferCopy region;
+};
+
+// uploads gathered between two flushes, submitted together
+struct vk_staging_batch {
+  struct vk_staging_copy *copies;
+  int num_copies;
+  int max_copies;
+
+  // on the graphics queue, waits for the copies so the work submitted after
+  // it sees them. Unused when both are the same family.
+  VkCommandBuffer acquire_command_buffer;
+  VkSemaphore uploaded_semaphore;
+
+  VkCommandBuffer copy_command_buffer;
+  VkFence fence;
+
+  // ring position the batch's data ends at
+  uint64_t end;
+  bool in_flight;
+};
+
+struct vk_staging_stats {
+  uint64_t uploads;
+  uint64_t bytes;
+  uint64_t batches;
+  // uploads refused because the ring or the batches were all in use
+  uint64_t rejected;
+};
+
+// persistently mapped ring of host memory uploads are copied through. Its
+// data is freed batch by batch, as the GPU finishes with it, so the host only
+// ever waits when tearing it down.
+struct vk_staging {
+  struct vk_device *vk_dev;
+
+  VkBuffer buffer;
+  struct vk_allocation allocation;
+  VkDeviceSize alignment;
+
+  // positions grow forever, the ring offset is the position modulo its size
+  uint64_t head;
+  uint64_t tail;
+
+  VkCommandPool transfer_command_pool;
+  VkCommandPool graphics_command_pool;
+  // the copies run on a queue of their own
+  bool separate_queue;
+
+  struct vk_staging_batch batches[VK_STAGING_BATCHES];
+  // the batch being filled, the ones after it are the oldest in flight
+  int current;
+
+  struct vk_staging_stats stats;
+};
+
+struct vk_staging *vk_staging_create(struct vk_device *vk_dev);
+
+// waits for the batches still in flight
+void vk_staging_destroy(struct vk_staging *staging);
+
+// queue families destinations are shared between, as nothing transfers
+// their ownership. Returns how many there are, 1 when they can be exclusive.
+uint32_t vk_staging_queue_families(struct vk_staging *staging, uint32_t families[2]);
+
+// reserves size bytes of the ring for the caller to fill, copied into the
+// destination buffer range at the next flush, or returns NULL without
+// blocking when the ring has no room left. The range must not be used by any
+// work still in flight, and is only read by work submitted after the flush.
+void *vk_staging_map_buffer(struct vk_staging *staging, VkBuffer buffer,
+  VkDeviceSize offset, VkDeviceSize size);
+
+// same, copying the data straight away
+bool vk_staging_upload_buffer(struct vk_staging *staging, VkBuffer buffer,
+  VkDeviceSize offset, const void *data, VkDeviceSize size);
+
+// submits the uploads made since the last flush on the transfer queue. Work
+// the caller submits on the graphics queue afterwards sees their results.
+bool vk_staging_flush(struct vk_staging *staging);
+
+#endif  // VK_STAGING_H_
@@ -1,11 +1,30 @@
 #version 450
 
-vec2 positions[3] = vec2[](
-    vec2(0.0, -0.5),
-    vec2(0.5, 0.5),
-    vec2(-0.5, 0.5)
-);
+struct Quad {
+  vec4 rect;
+  vec4 uv;
+  vec4 color;
+  uint layer;
+};
+
+layout(set = 0, binding = 0) uniform Draw {
+  vec2 viewport;
+} draw;
+
+// draws start at their batch's first instance, within the frame's slice
+layout(std430, set = 0, binding = 1) readonly buffer Quads {
+  Quad quads[];
+};
+
+layout(location = 0) out vec4 color;
 
 void main() {
-  gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
+  Quad quad = quads[gl_InstanceIndex];
+
+  // triangle strip over the corners (0, 0), (1, 0), (0, 1), (1, 1)
+  vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+  vec2 position = quad.rect.xy + corner * quad.rect.zw;
+
+  gl_Position = vec4(position / draw.viewport * 2.0 - 1.0, 0.0, 1.0);
+  color = quad.color;
 }
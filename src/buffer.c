@@ -0,0 +1,543 @@
+#include "buffer.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <gbm.h>
+#include <vulkan/vulkan.h>
+
+#include "device.h"
+#include "vk_device.h"
+
+VkFormat vk_format_from_drm(uint32_t drm_format)
+{
+  switch (drm_format) {
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+      return VK_FORMAT_B8G8R8A8_SRGB;
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+      return VK_FORMAT_R8G8B8A8_SRGB;
+    default:
+      return VK_FORMAT_UNDEFINED;
+  }
+}
+
+VkFormat vk_storage_format_from_drm(uint32_t drm_format)
+{
+  switch (drm_format) {
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+      return VK_FORMAT_B8G8R8A8_UNORM;
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+      return VK_FORMAT_R8G8B8A8_UNORM;
+    default:
+      return VK_FORMAT_UNDEFINED;
+  }
+}
+
+VkImageUsageFlags buffer_image_usage(struct vk_device *vk_dev)
+{
+  // transfers composite layers without an overlay plane into the frame
+  VkImageUsageFlags usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+    VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+  // or the compute compositor samples layers and stores to the frame
+  if (vk_dev->compute_composition) {
+    usage |= VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+  }
+
+  return usage;
+}
+
+VkImageCreateFlags buffer_image_flags(struct vk_device *vk_dev)
+{
+  // the compositor goes through a UNORM view
+  return vk_dev->compute_composition ? VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT : 0;
+}
+
+static int find_memory_type(struct vk_device *vk_dev, uint32_t type_bits)
+{
+  VkPhysicalDeviceMemoryProperties props;
+  vkGetPhysicalDeviceMemoryProperties(vk_dev->physical_device, &props);
+
+  for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+    if (type_bits & (1u << i)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static bool buffer_export_dmabuf(struct buffer *buffer)
+{
+  struct dmabuf_attributes *dmabuf = &buffer->dmabuf;
+
+  dmabuf->width = gbm_bo_get_width(buffer->bo);
+  dmabuf->height = gbm_bo_get_height(buffer->bo);
+  dmabuf->format = gbm_bo_get_format(buffer->bo);
+  dmabuf->modifier = gbm_bo_get_modifier(buffer->bo);
+  dmabuf->num_planes = gbm_bo_get_plane_count(buffer->bo);
+
+  if (dmabuf->num_planes <= 0 || dmabuf->num_planes > BUFFER_MAX_PLANES) {
+    fprintf(stderr, "Unsupported number of buffer planes: %d\n", dmabuf->num_planes);
+    return false;
+  }
+
+  // all planes of a gbm buffer object live in the same dmabuf
+  int fd = gbm_bo_get_fd(buffer->bo);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to export buffer as dmabuf\n");
+    return false;
+  }
+
+  for (int i = 0; i < dmabuf->num_planes; i++) {
+    dmabuf->fds[i] = fd;
+    dmabuf->offsets[i] = gbm_bo_get_offset(buffer->bo, i);
+    dmabuf->strides[i] = gbm_bo_get_stride_for_plane(buffer->bo, i);
+  }
+
+  return true;
+}
+
+static bool buffer_add_framebuffer(struct buffer *buffer)
+{
+  struct dmabuf_attributes *dmabuf = &buffer->dmabuf;
+
+  uint32_t handles[BUFFER_MAX_PLANES] = {0};
+  uint64_t modifiers[BUFFER_MAX_PLANES] = {0};
+
+  for (int i = 0; i < dmabuf->num_planes; i++) {
+    handles[i] = buffer->bo ? gbm_bo_get_handle_for_plane(buffer->bo, i).u32 :
+      buffer->handles[i];
+    modifiers[i] = dmabuf->modifier;
+  }
+
+  // producers that don't know their layout leave it to the driver
+  uint32_t flags = dmabuf->modifier != DRM_FORMAT_MOD_INVALID ? DRM_MODE_FB_MODIFIERS : 0;
+
+  int err = drmModeAddFB2WithModifiers(buffer->device->kms_fd, dmabuf->width, dmabuf->height,
+    dmabuf->format, handles, dmabuf->strides, dmabuf->offsets, modifiers, &buffer->fb_id,
+    flags);
+
+  if (err != 0) {
+    fprintf(stderr, "drmModeAddFB2WithModifiers failed: %s\n", strerror(-err));
+    return false;
+  }
+
+  return true;
+}
+
+static bool buffer_import_vk(struct buffer *buffer)
+{
+  VkResult res;
+
+  struct vk_device *vk_dev = buffer->device->vk_device;
+  struct dmabuf_attributes *dmabuf = &buffer->dmabuf;
+
+  VkFormat format = vk_format_from_drm(dmabuf->format);
+  if (format == VK_FORMAT_UNDEFINED) {
+    fprintf(stderr, "No Vulkan format for DRM format 0x%08x\n", dmabuf->format);
+    return false;
+  }
+
+  // Vulkan binds a single memory object to the image
+  for (int i = 1; i < dmabuf->num_planes; i++) {
+    struct stat first;
+    struct stat plane;
+    if (dmabuf->fds[i] != dmabuf->fds[0] && (fstat(dmabuf->fds[0], &first) != 0 ||
+      fstat(dmabuf->fds[i], &plane) != 0 || first.st_ino != plane.st_ino))
+    {
+      fprintf(stderr, "Can't import a buffer with planes in separate dmabufs\n");
+      return false;
+    }
+  }
+
+  // the explicit modifier import needs the real layout, guessing at linear
+  // would misread tiled buffers
+  if (dmabuf->modifier == DRM_FORMAT_MOD_INVALID) {
+    fprintf(stderr, "Can't import a buffer without a modifier into Vulkan\n");
+    return false;
+  }
+
+  // tiled layouts are private to the device that allocated them
+  if (vk_dev->prime && dmabuf->modifier != DRM_FORMAT_MOD_LINEAR) {
+    fprintf(stderr, "Can't share a buffer with modifier 0x%016llx across devices\n",
+      (unsigned long long)dmabuf->modifier);
+    return false;
+  }
+
+  VkSubresourceLayout plane_layouts[BUFFER_MAX_PLANES] = {0};
+  for (int i = 0; i < dmabuf->num_planes; i++) {
+    plane_layouts[i].offset = dmabuf->offsets[i];
+    plane_layouts[i].rowPitch = dmabuf->strides[i];
+  }
+
+  VkImageDrmFormatModifierExplicitCreateInfoEXT modifier_info = {0};
+  modifier_info.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT;
+  modifier_info.drmFormatModifier = dmabuf->modifier;
+  modifier_info.drmFormatModifierPlaneCount = dmabuf->num_planes;
+  modifier_info.pPlaneLayouts = plane_layouts;
+
+  // same channel order as the image, the compositor reads and writes raw texels
+  VkFormat storage_format = vk_storage_format_from_drm(dmabuf->format);
+  VkFormat view_formats[] = { format, storage_format };
+
+  VkImageFormatListCreateInfo format_list = {0};
+  format_list.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO;
+  format_list.viewFormatCount = 2;
+  format_list.pViewFormats = view_formats;
+
+  if (vk_dev->compute_composition) {
+    modifier_info.pNext = &format_list;
+  }
+
+  VkExternalMemoryImageCreateInfo external_info = {0};
+  external_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+  external_info.pNext = &modifier_info;
+  external_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+  VkImageCreateInfo image_info = {0};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.pNext = &external_info;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = format;
+  image_info.extent.width = dmabuf->width;
+  image_info.extent.height = dmabuf->height;
+  image_info.extent.depth = 1;
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+  image_info.flags = buffer_image_flags(vk_dev);
+  image_info.usage = buffer_image_usage(vk_dev);
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  // rendered on the graphics queue, composited on the compute queue
+  uint32_t families[] = { vk_dev->queue_family, vk_dev->compute_queue_family };
+  if (vk_dev->compute_composition && families[0] != families[1]) {
+    image_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    image_info.queueFamilyIndexCount = 2;
+    image_info.pQueueFamilyIndices = families;
+  }
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  res = vkCreateImage(vk_dev->device, &image_info, NULL, &buffer->image);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to create dmabuf image: %d\n", res);
+    return false;
+  }
+
+  VkMemoryFdPropertiesKHR fd_props = {0};
+  fd_props.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR;
+
+  res = vk_dev->get_memory_fd_properties(vk_dev->device,
+    VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, dmabuf->fds[0], &fd_props);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkGetMemoryFdPropertiesKHR failed: %d\n", res);
+    goto err_image;
+  }
+
+  VkImageMemoryRequirementsInfo2 req_info = {0};
+  req_info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+  req_info.image = buffer->image;
+
+  VkMemoryRequirements2 reqs = {0};
+  reqs.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+  vkGetImageMemoryRequirements2(vk_dev->device, &req_info, &reqs);
+
+  int memory_type = find_memory_type(vk_dev,
+    reqs.memoryRequirements.memoryTypeBits & fd_props.memoryTypeBits);
+  if (memory_type < 0) {
+    fprintf(stderr, "No memory type suitable for dmabuf import\n");
+    goto err_image;
+  }
+
+  // vulkan takes ownership of the fd on a successful import
+  int fd = dup(dmabuf->fds[0]);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to dup dmabuf fd\n");
+    goto err_image;
+  }
+
+  VkMemoryDedicatedAllocateInfo dedicated_info = {0};
+  dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+  dedicated_info.image = buffer->image;
+
+  VkImportMemoryFdInfoKHR import_info = {0};
+  import_info.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR;
+  import_info.pNext = &dedicated_info;
+  import_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+  import_info.fd = fd;
+
+  VkMemoryAllocateInfo alloc_info = {0};
+  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  alloc_info.pNext = &import_info;
+  alloc_info.allocationSize = reqs.memoryRequirements.size;
+  alloc_info.memoryTypeIndex = memory_type;
+
+  res = vkAllocateMemory(vk_dev->device, &alloc_info, NULL, &buffer->memory);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to import dmabuf memory: %d\n", res);
+    close(fd);
+    goto err_image;
+  }
+
+  res = vkBindImageMemory(vk_dev->device, buffer->image, buffer->memory, 0);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to bind dmabuf memory: %d\n", res);
+    goto err_memory;
+  }
+
+  VkImageViewCreateInfo view_info = {0};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = buffer->image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = format;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.layerCount = 1;
+
+  res = vkCreateImageView(vk_dev->device, &view_info, NULL, &buffer->image_view);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to create dmabuf image view: %d\n", res);
+    goto err_memory;
+  }
+
+  VkFramebufferCreateInfo fb_info = {0};
+  fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  fb_info.renderPass = vk_dev->render_pass;
+  fb_info.attachmentCount = 1;
+  fb_info.pAttachments = &buffer->image_view;
+  fb_info.width = dmabuf->width;
+  fb_info.height = dmabuf->height;
+  fb_info.layers = 1;
+
+  res = vkCreateFramebuffer(vk_dev->device, &fb_info, NULL, &buffer->framebuffer);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to create vulkan framebuffer: %d\n", res);
+    goto err_view;
+  }
+
+  if (vk_dev->compute_composition) {
+    view_info.format = storage_format;
+
+    res = vkCreateImageView(vk_dev->device, &view_info, NULL, &buffer->storage_view);
+    if (res != VK_SUCCESS) {
+      fprintf(stderr, "Failed to create dmabuf storage view: %d\n", res);
+      goto err_framebuffer;
+    }
+  }
+
+  return true;
+
+err_framebuffer:
+  vkDestroyFramebuffer(vk_dev->device, buffer->framebuffer, NULL);
+  buffer->framebuffer = VK_NULL_HANDLE;
+
+err_view:
+  vkDestroyImageView(vk_dev->device, buffer->image_view, NULL);
+  buffer->image_view = VK_NULL_HANDLE;
+
+err_memory:
+  vkFreeMemory(vk_dev->device, buffer->memory, NULL);
+  buffer->memory = VK_NULL_HANDLE;
+
+err_image:
+  vkDestroyImage(vk_dev->device, buffer->image, NULL);
+  buffer->image = VK_NULL_HANDLE;
+
+  return false;
+}
+
+struct buffer *buffer_create(struct device *device, uint32_t width, uint32_t height,
+  uint32_t format, const uint64_t *modifiers, int num_modifiers)
+{
+  struct buffer *ret = calloc(1, sizeof(*ret));
+  assert(ret);
+
+  ret->device = device;
+  ret->release_fence_fd = -1;
+  for (int i = 0; i < BUFFER_MAX_PLANES; i++) {
+    ret->dmabuf.fds[i] = -1;
+  }
+
+  ret->bo = gbm_bo_create_with_modifiers(device->gbm_device, width, height, format,
+    modifiers, num_modifiers);
+
+  if (!ret->bo) {
+    fprintf(stderr, "Failed to allocate %ux%u buffer object\n", width, height);
+    goto err;
+  }
+
+  if (!buffer_export_dmabuf(ret)) {
+    goto err_bo;
+  }
+
+  if (!buffer_add_framebuffer(ret)) {
+    goto err_bo;
+  }
+
+  if (!buffer_import_vk(ret)) {
+    goto err_fb;
+  }
+
+  return ret;
+
+err_fb:
+  drmModeRmFB(device->kms_fd, ret->fb_id);
+
+err_bo:
+  if (ret->dmabuf.fds[0] >= 0) {
+    close(ret->dmabuf.fds[0]);
+  }
+  gbm_bo_destroy(ret->bo);
+
+err:
+  free(ret);
+  return NULL;
+}
+
+// planes of a client buffer may share their GEM handle, each is closed once
+static void close_handles(struct device *device, const uint32_t *handles, int num_planes)
+{
+  for (int i = 0; i < num_planes; i++) {
+    bool closed = handles[i] == 0;
+    for (int j = 0; j < i; j++) {
+      closed |= handles[j] == handles[i];
+    }
+
+    if (!closed) {
+      drmCloseBufferHandle(device->kms_fd, handles[i]);
+    }
+  }
+}
+
+struct buffer *buffer_import(struct device *device, const struct dmabuf_attributes *dmabuf)
+{
+  if (dmabuf->num_planes <= 0 || dmabuf->num_planes > BUFFER_MAX_PLANES) {
+    fprintf(stderr, "Unsupported number of buffer planes: %d\n", dmabuf->num_planes);
+    return NULL;
+  }
+
+  struct buffer *ret = calloc(1, sizeof(*ret));
+  assert(ret);
+
+  ret->device = device;
+  ret->release_fence_fd = -1;
+  ret->dmabuf = *dmabuf;
+
+  for (int i = 0; i < dmabuf->num_planes; i++) {
+    if (drmPrimeFDToHandle(device->kms_fd, dmabuf->fds[i], &ret->handles[i]) != 0) {
+      fprintf(stderr, "Failed to import dmabuf plane %d: %s\n", i, strerror(errno));
+      goto err;
+    }
+  }
+
+  if (!buffer_add_framebuffer(ret)) {
+    // still fine for composition
+    ret->fb_id = 0;
+  }
+
+  return ret;
+
+err:
+  close_handles(device, ret->handles, dmabuf->num_planes);
+  free(ret);
+  return NULL;
+}
+
+bool buffer_import_image(struct buffer *buffer)
+{
+  if (buffer->image) {
+    return true;
+  }
+
+  // don't retry a failed import every frame
+  if (buffer->vk_import_failed) {
+    return false;
+  }
+
+  buffer->vk_import_failed = !buffer_import_vk(buffer);
+
+  return !buffer->vk_import_failed;
+}
+
+void buffer_destroy(struct buffer *buffer)
+{
+  struct vk_device *vk_dev = buffer->device->vk_device;
+
+  if (buffer->command_buffer) {
+    vkWaitForFences(vk_dev->device, 1, &buffer->fence, VK_TRUE, UINT64_MAX);
+    vkFreeCommandBuffers(vk_dev->device, vk_dev->command_pool, 1, &buffer->command_buffer);
+  }
+
+  vkDestroyFence(vk_dev->device, buffer->fence, NULL);
+  vkDestroySemaphore(vk_dev->device, buffer->render_semaphore, NULL);
+  vkDestroySemaphore(vk_dev->device, buffer->release_semaphore, NULL);
+
+  if (buffer->release_fence_fd >= 0) {
+    close(buffer->release_fence_fd);
+  }
+
+  if (buffer->compose_command_buffer) {
+    vkFreeCommandBuffers(vk_dev->device, vk_dev->compute_command_pool, 1,
+      &buffer->compose_command_buffer);
+  }
+  vkDestroySemaphore(vk_dev->device, buffer->rendered_semaphore, NULL);
+
+  vkDestroyFramebuffer(vk_dev->device, buffer->framebuffer, NULL);
+  vkDestroyImageView(vk_dev->device, buffer->storage_view, NULL);
+  vkDestroyImageView(vk_dev->device, buffer->image_view, NULL);
+  vkDestroyImage(vk_dev->device, buffer->image, NULL);
+  vkFreeMemory(vk_dev->device, buffer->memory, NULL);
+
+  if (buffer->fb_id) {
+    drmModeRmFB(buffer->device->kms_fd, buffer->fb_id);
+  }
+
+  if (buffer->bo) {
+    // every plane shares the same dmabuf fd
+    if (buffer->dmabuf.fds[0] >= 0) {
+      close(buffer->dmabuf.fds[0]);
+    }
+
+    gbm_bo_destroy(buffer->bo);
+  } else {
+    close_handles(buffer->device, buffer->handles, buffer->dmabuf.num_planes);
+
+    // planes of a client buffer may share their fd as well
+    for (int i = 0; i < buffer->dmabuf.num_planes; i++) {
+      bool fd_closed = false;
+      for (int j = 0; j < i; j++) {
+        fd_closed |= buffer->dmabuf.fds[j] == buffer->dmabuf.fds[i];
+      }
+
+      if (!fd_closed) {
+        close(buffer->dmabuf.fds[i]);
+      }
+    }
+  }
+
+  free(buffer);
+}
+
+bool buffer_is_idle(struct buffer *buffer)
+{
+  if (!buffer->fence) {
+    return true;
+  }
+
+  struct vk_device *vk_dev = buffer->device->vk_device;
+  return vkGetFenceStatus(vk_dev->device, buffer->fence) == VK_SUCCESS;
+}
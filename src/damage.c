@@ -0,0 +1,119 @@
+#include "damage.h"
+
+static bool rect_contains(const struct damage_rect *outer, const struct damage_rect *inner)
+{
+  return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+    outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+static void rect_union(struct damage_rect *dst, const struct damage_rect *src)
+{
+  if (src->x1 < dst->x1) {
+    dst->x1 = src->x1;
+  }
+  if (src->y1 < dst->y1) {
+    dst->y1 = src->y1;
+  }
+  if (src->x2 > dst->x2) {
+    dst->x2 = src->x2;
+  }
+  if (src->y2 > dst->y2) {
+    dst->y2 = src->y2;
+  }
+}
+
+void damage_clear(struct damage *damage)
+{
+  damage->num_rects = 0;
+}
+
+bool damage_is_empty(const struct damage *damage)
+{
+  return damage->num_rects == 0;
+}
+
+struct damage_rect damage_extents(const struct damage *damage)
+{
+  struct damage_rect ret = {0};
+
+  if (damage->num_rects == 0) {
+    return ret;
+  }
+
+  ret = damage->rects[0];
+  for (int i = 1; i < damage->num_rects; i++) {
+    rect_union(&ret, &damage->rects[i]);
+  }
+
+  return ret;
+}
+
+void damage_add_rect(struct damage *damage, int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+  struct damage_rect rect = { x1, y1, x2, y2 };
+
+  if (x1 >= x2 || y1 >= y2) {
+    return;
+  }
+
+  for (int i = 0; i < damage->num_rects; i++) {
+    if (rect_contains(&damage->rects[i], &rect)) {
+      return;
+    }
+  }
+
+  // drop the rectangles the new one covers
+  int n = 0;
+  for (int i = 0; i < damage->num_rects; i++) {
+    if (!rect_contains(&rect, &damage->rects[i])) {
+      damage->rects[n++] = damage->rects[i];
+    }
+  }
+  damage->num_rects = n;
+
+  if (damage->num_rects == DAMAGE_MAX_RECTS) {
+    struct damage_rect extents = damage_extents(damage);
+    rect_union(&extents, &rect);
+    damage->rects[0] = extents;
+    damage->num_rects = 1;
+    return;
+  }
+
+  damage->rects[damage->num_rects++] = rect;
+}
+
+void damage_add(struct damage *damage, const struct damage *other)
+{
+  for (int i = 0; i < other->num_rects; i++) {
+    const struct damage_rect *rect = &other->rects[i];
+    damage_add_rect(damage, rect->x1, rect->y1, rect->x2, rect->y2);
+  }
+}
+
+void damage_clip(struct damage *damage, uint32_t width, uint32_t height)
+{
+  int n = 0;
+
+  for (int i = 0; i < damage->num_rects; i++) {
+    struct damage_rect rect = damage->rects[i];
+
+    if (rect.x1 < 0) {
+      rect.x1 = 0;
+    }
+    if (rect.y1 < 0) {
+      rect.y1 = 0;
+    }
+    if (rect.x2 > (int32_t)width) {
+      rect.x2 = width;
+    }
+    if (rect.y2 > (int32_t)height) {
+      rect.y2 = height;
+    }
+
+    if (rect.x1 < rect.x2 && rect.y1 < rect.y2) {
+      damage->rects[n++] = rect;
+    }
+  }
+
+  damage->num_rects = n;
+}
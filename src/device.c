@@ -24,21 +24,49 @@
 #define O_CLOEXEC	02000000  /* set close_on_exec */
 #endif
 
+#include "drm_props.h"
+#include "modifiers.h"
 #include "output.h"
+#include "profiler.h"
+#include "swapchain.h"
 #include "vk_device.h"
 
-static struct device *device_open(const char *filename) {
+static bool driver_matches(int fd, const char *driver)
+{
+  if (!driver) {
+    return true;
+  }
+
+  drmVersionPtr version = drmGetVersion(fd);
+  if (!version) {
+    return false;
+  }
+
+  bool ret = strcmp(version->name, driver) == 0;
+  drmFreeVersion(version);
+  return ret;
+}
+
+static struct device *device_open(const char *filename, const char *driver,
+  struct vk_probe *probe) {
   int err = 0;
+  int stage;
 
   struct device *ret = calloc(1, sizeof(*ret));
   assert(ret);
 
+  stage = profiler_begin("kms resources");
+
   ret->kms_fd = open(filename, O_RDWR | O_CLOEXEC);
   if (ret->kms_fd < 0) {
     fprintf(stderr, "Couldn't open %s: %s\n", filename, strerror(errno));
     goto err;
   }
 
+  if (!driver_matches(ret->kms_fd, driver)) {
+    goto err_fd;
+  }
+
   // drm_magic_t magic;
   // int cookie = drmGetMagic(ret->kms_fd, &magic);
   // int auth = drmAuthMagic(ret->kms_fd, magic);
@@ -68,6 +96,9 @@ static struct device *device_open(const char *filename) {
   printf("Device %s framebuffer modifiers\n",
     (ret->fb_modifiers) ? "supports" : "does not support");
 
+  err = drmGetCap(ret->kms_fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap);
+  ret->monotonic_timestamps = (err == 0 && cap != 0);
+
   ret->res = drmModeGetResources(ret->kms_fd);
   if (!ret->res) {
     fprintf(stderr, "Couldn't get card resources for %s\n", filename);
@@ -98,8 +129,21 @@ static struct device *device_open(const char *filename) {
     assert(ret->planes[i]);
   }
 
+  profiler_end(stage);
+
+  stage = profiler_begin("kms properties");
+  bool have_props = drm_props_init(ret);
+  profiler_end(stage);
+
+  if (!have_props) {
+    goto err_planes;
+  }
+
+  stage = profiler_begin("outputs");
+
   ret->outputs = calloc(ret->res->count_connectors, sizeof(*ret->outputs));
-  assert(ret->outputs);
+  ret->removed_outputs = calloc(ret->res->count_connectors, sizeof(*ret->removed_outputs));
+  assert(ret->outputs && ret->removed_outputs);
 
   for (int i = 0; i < ret->res->count_connectors; i++) {
     drmModeConnectorPtr connector = drmModeGetConnector(ret->kms_fd, ret->res->connectors[i]);
@@ -112,14 +156,50 @@ static struct device *device_open(const char *filename) {
     ret->outputs[ret->num_outputs++] = output;
   }
 
+  profiler_end(stage);
+
   if (ret->num_outputs == 0) {
     fprintf(stderr, "Device %s has no active outputs\n", filename);
     goto err_outputs;
   }
 
+  stage = profiler_begin("gbm");
   ret->gbm_device = gbm_create_device(ret->kms_fd);
+  profiler_end(stage);
+
+  if (!ret->gbm_device) {
+    fprintf(stderr, "Couldn't create GBM device for %s\n", filename);
+    goto err_outputs;
+  }
+
+  ret->vk_probe = probe;
+  ret->vk_device = vk_device_create(ret, probe);
+  if (!ret->vk_device) {
+    fprintf(stderr, "Device %s has no usable Vulkan device\n", filename);
+    goto err_outputs;
+  }
+
+  stage = profiler_begin("swapchains");
+
+  for (int i = 0; i < ret->num_outputs; i++) {
+    struct output *output = ret->outputs[i];
+    output->swapchain = swapchain_create(output);
+
+    if (!output->swapchain) {
+      fprintf(stderr, "Failed to create swapchain for output %d\n", output->connector_id);
+      goto err_outputs;
+    }
+  }
+
+  profiler_end(stage);
+
+  stage = profiler_begin("takeover");
+
+  for (int i = 0; i < ret->num_outputs; i++) {
+    output_takeover(ret->outputs[i]);
+  }
 
-  ret->vk_device = vk_device_create(ret);
+  profiler_end(stage);
 
   printf("Using device %s with %d outputs and %d planes\n", filename,
     ret->num_outputs, ret->num_planes);
@@ -127,7 +207,22 @@ static struct device *device_open(const char *filename) {
   return ret;
 
 err_outputs:
+  // swapchains go with their outputs, before the device they were made on
+  for (int i = 0; i < ret->num_outputs; i++) {
+    output_destroy(ret->outputs[i]);
+  }
+  if (ret->vk_device) {
+    vk_device_destroy(ret->vk_device);
+  }
+  if (ret->gbm_device) {
+    gbm_device_destroy(ret->gbm_device);
+  }
+  modifiers_finish(ret);
   free(ret->outputs);
+  free(ret->removed_outputs);
+  drm_props_finish(ret);
+
+err_planes:
   for (int i = 0; i < ret->num_planes; i++) {
     drmModeFreePlane(ret->planes[i]);
   }
@@ -147,11 +242,134 @@ err:
   return NULL;
 }
 
-struct device* device_create() {
+static int output_index(struct device *device, uint32_t connector_id)
+{
+  for (int i = 0; i < device->num_outputs; i++) {
+    if (device->outputs[i]->connector_id == connector_id) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+void device_invalidate_plane_caches(struct device *device)
+{
+  for (int i = 0; i < device->num_outputs; i++) {
+    plane_allocator_invalidate(&device->outputs[i]->planes);
+  }
+}
+
+bool device_add_output(struct device *device, drmModeConnectorPtr connector)
+{
+  // hotplug events can queue more than one probe of a connector
+  if (output_index(device, connector->connector_id) >= 0) {
+    return false;
+  }
+
+  struct output *output = output_create_modeset(device, connector);
+  if (!output) {
+    return false;
+  }
+
+  output->swapchain = swapchain_create(output);
+  if (!output->swapchain) {
+    fprintf(stderr, "Failed to create swapchain for output %d\n", output->connector_id);
+    output_destroy(output);
+    return false;
+  }
+
+  // outputs has room for every connector
+  device->outputs[device->num_outputs++] = output;
+
+  // nothing is on screen yet, the whole output starts out damaged
+  scheduler_wake(&output->scheduler);
+
+  printf("Output %d connected\n", connector->connector_id);
+  return true;
+}
+
+static void device_remove_output(struct device *device, int index)
+{
+  struct output *output = device->outputs[index];
+
+  memmove(&device->outputs[index], &device->outputs[index + 1],
+    (device->num_outputs - index - 1) * sizeof(*device->outputs));
+  device->num_outputs--;
+
+  // a connector can only be removed while it has an output, so there is
+  // room for every one of them
+  device->removed_outputs[device->num_removed_outputs++] = output;
+
+  printf("Output %d disconnected\n", output->connector_id);
+
+  output_remove(output);
+}
+
+void device_destroy_removed_output(struct device *device, struct output *output)
+{
+  for (int i = 0; i < device->num_removed_outputs; i++) {
+    if (device->removed_outputs[i] == output) {
+      memmove(&device->removed_outputs[i], &device->removed_outputs[i + 1],
+        (device->num_removed_outputs - i - 1) * sizeof(*device->removed_outputs));
+      device->num_removed_outputs--;
+      break;
+    }
+  }
+
+  output_destroy(output);
+}
+
+bool device_hotplug(struct device *device, uint32_t connector_id, uint32_t *connected,
+  int *num_connected)
+{
+  bool changed = false;
+  *num_connected = 0;
+
+  for (int i = 0; i < device->res->count_connectors; i++) {
+    uint32_t id = device->res->connectors[i];
+    if (connector_id != 0 && id != connector_id) {
+      continue;
+    }
+
+    // the kernel already detected the change, the cached state is current
+    drmModeConnectorPtr connector = drmModeGetConnectorCurrent(device->kms_fd, id);
+    if (!connector) {
+      continue;
+    }
+
+    bool is_connected = connector->connection == DRM_MODE_CONNECTED;
+    drmModeFreeConnector(connector);
+
+    int index = output_index(device, id);
+
+    if (is_connected && index < 0) {
+      connected[(*num_connected)++] = id;
+    } else if (!is_connected && index >= 0) {
+      device_remove_output(device, index);
+      changed = true;
+    }
+  }
+
+  // outputs share bandwidth and scalers, what the others could show before
+  // doesn't say much once one goes
+  if (changed) {
+    device_invalidate_plane_caches(device);
+  }
+
+  return changed;
+}
+
+struct device* device_create(const char *driver) {
+  // vulkan needs nothing from KMS until a physical device is picked
+  struct vk_probe *probe = vk_probe_start();
+
+  int stage = profiler_begin("drm enumeration");
   int num_devices = drmGetDevices2(0, NULL, 0);
 
   if (num_devices <= 0) {
     fprintf(stderr, "No KSM devices present\n");
+    profiler_end(stage);
     goto err;
   }
 
@@ -161,6 +379,8 @@ struct device* device_create() {
   drmGetDevices2(0, devices, num_devices);
   printf("%d DRM devices available\n", num_devices);
 
+  profiler_end(stage);
+
   struct device *ret = NULL;
 
   for (int i = 0; i < num_devices; i++) {
@@ -171,7 +391,7 @@ struct device* device_create() {
     }
 
     const char* filename = candidate->nodes[DRM_NODE_PRIMARY];
-    ret = device_open(filename);
+    ret = device_open(filename, driver, probe);
 
     if (ret) {
       break;
@@ -185,6 +405,9 @@ struct device* device_create() {
     goto err;
   }
 
+  return ret;
+
 err:
+  vk_probe_destroy(probe);
   return NULL;
 }
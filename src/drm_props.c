@@ -0,0 +1,313 @@
+#include "drm_props.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "device.h"
+
+static const char *plane_prop_names[PLANE_PROP_COUNT] = {
+  [PLANE_PROP_TYPE] = "type",
+  [PLANE_PROP_FB_ID] = "FB_ID",
+  [PLANE_PROP_CRTC_ID] = "CRTC_ID",
+  [PLANE_PROP_SRC_X] = "SRC_X",
+  [PLANE_PROP_SRC_Y] = "SRC_Y",
+  [PLANE_PROP_SRC_W] = "SRC_W",
+  [PLANE_PROP_SRC_H] = "SRC_H",
+  [PLANE_PROP_CRTC_X] = "CRTC_X",
+  [PLANE_PROP_CRTC_Y] = "CRTC_Y",
+  [PLANE_PROP_CRTC_W] = "CRTC_W",
+  [PLANE_PROP_CRTC_H] = "CRTC_H",
+  [PLANE_PROP_IN_FENCE_FD] = "IN_FENCE_FD",
+  [PLANE_PROP_ZPOS] = "zpos",
+  [PLANE_PROP_IN_FORMATS] = "IN_FORMATS",
+  [PLANE_PROP_FB_DAMAGE_CLIPS] = "FB_DAMAGE_CLIPS",
+};
+
+static const char *crtc_prop_names[CRTC_PROP_COUNT] = {
+  [CRTC_PROP_ACTIVE] = "ACTIVE",
+  [CRTC_PROP_MODE_ID] = "MODE_ID",
+  [CRTC_PROP_OUT_FENCE_PTR] = "OUT_FENCE_PTR",
+  [CRTC_PROP_VRR_ENABLED] = "VRR_ENABLED",
+};
+
+static const char *connector_prop_names[CONNECTOR_PROP_COUNT] = {
+  [CONNECTOR_PROP_CRTC_ID] = "CRTC_ID",
+  [CONNECTOR_PROP_VRR_CAPABLE] = "vrr_capable",
+};
+
+// fills ids and values for the named properties the object has, and hands
+// each matched property to a callback while its metadata is at hand
+static bool resolve_props(struct device *device, uint32_t object_id, uint32_t object_type,
+  const char **names, int count, uint32_t *ids, uint64_t *values,
+  void (*matched)(void *data, int index, drmModePropertyPtr prop), void *data)
+{
+  drmModeObjectPropertiesPtr props =
+    drmModeObjectGetProperties(device->kms_fd, object_id, object_type);
+  if (!props) {
+    fprintf(stderr, "Couldn't get properties of KMS object %d\n", object_id);
+    return false;
+  }
+
+  for (uint32_t p = 0; p < props->count_props; p++) {
+    drmModePropertyPtr prop = drmModeGetProperty(device->kms_fd, props->props[p]);
+    if (!prop) {
+      continue;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (strcmp(names[i], prop->name) == 0) {
+        ids[i] = prop->prop_id;
+        values[i] = props->prop_values[p];
+        if (matched) {
+          matched(data, i, prop);
+        }
+        break;
+      }
+    }
+
+    drmModeFreeProperty(prop);
+  }
+
+  drmModeFreeObjectProperties(props);
+  return true;
+}
+
+static void plane_prop_matched(void *data, int index, drmModePropertyPtr prop)
+{
+  struct plane_props *props = data;
+
+  if (index != PLANE_PROP_ZPOS) {
+    return;
+  }
+
+  if ((prop->flags & (DRM_MODE_PROP_RANGE | DRM_MODE_PROP_SIGNED_RANGE)) &&
+    prop->count_values == 2)
+  {
+    props->zpos_min = prop->values[0];
+    props->zpos_max = prop->values[1];
+    props->zpos_mutable = !(prop->flags & DRM_MODE_PROP_IMMUTABLE);
+  }
+}
+
+bool drm_props_init(struct device *device)
+{
+  device->plane_props = calloc(device->num_planes, sizeof(*device->plane_props));
+  device->crtc_props = calloc(device->res->count_crtcs, sizeof(*device->crtc_props));
+  device->connector_props = calloc(device->res->count_connectors,
+    sizeof(*device->connector_props));
+  assert(device->plane_props && device->crtc_props && device->connector_props);
+
+  for (int i = 0; i < device->num_planes; i++) {
+    struct plane_props *props = &device->plane_props[i];
+    props->plane_id = device->planes[i]->plane_id;
+
+    if (!resolve_props(device, props->plane_id, DRM_MODE_OBJECT_PLANE, plane_prop_names,
+        PLANE_PROP_COUNT, props->ids, props->values, plane_prop_matched, props))
+    {
+      goto err;
+    }
+
+    if (props->ids[PLANE_PROP_ZPOS] && props->zpos_max == 0) {
+      // without a range the current value is the only one
+      props->zpos_min = props->values[PLANE_PROP_ZPOS];
+      props->zpos_max = props->values[PLANE_PROP_ZPOS];
+    }
+  }
+
+  for (int i = 0; i < device->res->count_crtcs; i++) {
+    struct crtc_props *props = &device->crtc_props[i];
+    props->crtc_id = device->res->crtcs[i];
+
+    if (!resolve_props(device, props->crtc_id, DRM_MODE_OBJECT_CRTC, crtc_prop_names,
+        CRTC_PROP_COUNT, props->ids, props->values, NULL, NULL))
+    {
+      goto err;
+    }
+  }
+
+  for (int i = 0; i < device->res->count_connectors; i++) {
+    struct connector_props *props = &device->connector_props[i];
+    props->connector_id = device->res->connectors[i];
+
+    if (!resolve_props(device, props->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+        connector_prop_names, CONNECTOR_PROP_COUNT, props->ids, props->values, NULL, NULL))
+    {
+      goto err;
+    }
+  }
+
+  return true;
+
+err:
+  drm_props_finish(device);
+  return false;
+}
+
+void drm_props_finish(struct device *device)
+{
+  free(device->plane_props);
+  free(device->crtc_props);
+  free(device->connector_props);
+  device->plane_props = NULL;
+  device->crtc_props = NULL;
+  device->connector_props = NULL;
+}
+
+const struct plane_props *drm_plane_props(struct device *device, uint32_t plane_id)
+{
+  for (int i = 0; i < device->num_planes; i++) {
+    if (device->plane_props[i].plane_id == plane_id) {
+      return &device->plane_props[i];
+    }
+  }
+
+  return NULL;
+}
+
+const struct crtc_props *drm_crtc_props(struct device *device, uint32_t crtc_id)
+{
+  for (int i = 0; i < device->res->count_crtcs; i++) {
+    if (device->crtc_props[i].crtc_id == crtc_id) {
+      return &device->crtc_props[i];
+    }
+  }
+
+  return NULL;
+}
+
+const struct connector_props *drm_connector_props(struct device *device, uint32_t connector_id)
+{
+  for (int i = 0; i < device->res->count_connectors; i++) {
+    if (device->connector_props[i].connector_id == connector_id) {
+      return &device->connector_props[i];
+    }
+  }
+
+  return NULL;
+}
+
+bool drm_plane_props_usable(const struct plane_props *props)
+{
+  for (int i = PLANE_PROP_FB_ID; i <= PLANE_PROP_IN_FENCE_FD; i++) {
+    if (props->ids[i] == 0) {
+      printf("Plane %d has no %s property\n", props->plane_id, plane_prop_names[i]);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool drm_crtc_props_usable(const struct crtc_props *props)
+{
+  if (props->ids[CRTC_PROP_OUT_FENCE_PTR] == 0) {
+    printf("CRTC %d has no OUT_FENCE_PTR property\n", props->crtc_id);
+    return false;
+  }
+
+  return true;
+}
+
+int drm_get_plane_type(struct device *device, uint32_t plane_id)
+{
+  const struct plane_props *props = drm_plane_props(device, plane_id);
+  if (!props || props->ids[PLANE_PROP_TYPE] == 0) {
+    return -1;
+  }
+
+  return (int)props->values[PLANE_PROP_TYPE];
+}
+
+bool drm_is_primary_plane(struct device *device, uint32_t plane_id)
+{
+  return drm_get_plane_type(device, plane_id) == DRM_PLANE_TYPE_PRIMARY;
+}
+
+static drmModePlanePtr find_plane(struct device *device, uint32_t plane_id)
+{
+  for (int i = 0; i < device->num_planes; i++) {
+    if (device->planes[i]->plane_id == plane_id) {
+      return device->planes[i];
+    }
+  }
+
+  return NULL;
+}
+
+static int parse_in_formats(drmModePropertyBlobPtr blob, struct format_modifier **formats)
+{
+  struct drm_format_modifier_blob *header = blob->data;
+  uint32_t *blob_formats = (uint32_t *)((char *)blob->data + header->formats_offset);
+  struct drm_format_modifier *modifiers =
+    (struct drm_format_modifier *)((char *)blob->data + header->modifiers_offset);
+
+  int count = 0;
+  for (uint32_t m = 0; m < header->count_modifiers; m++) {
+    count += __builtin_popcountll(modifiers[m].formats);
+  }
+
+  struct format_modifier *ret = calloc(count > 0 ? count : 1, sizeof(*ret));
+  assert(ret);
+
+  int n = 0;
+  for (uint32_t m = 0; m < header->count_modifiers; m++) {
+    // each modifier covers a 64 format window starting at its offset
+    for (int bit = 0; bit < 64; bit++) {
+      if (!(modifiers[m].formats & (1ULL << bit))) {
+        continue;
+      }
+
+      uint32_t index = modifiers[m].offset + bit;
+      if (index >= header->count_formats) {
+        continue;
+      }
+
+      ret[n].format = blob_formats[index];
+      ret[n].modifier = modifiers[m].modifier;
+      n++;
+    }
+  }
+
+  *formats = ret;
+  return n;
+}
+
+int drm_get_plane_formats(struct device *device, uint32_t plane_id,
+  struct format_modifier **formats)
+{
+  const struct plane_props *props = drm_plane_props(device, plane_id);
+
+  if (props && props->ids[PLANE_PROP_IN_FORMATS] && device->fb_modifiers) {
+    drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(device->kms_fd,
+      props->values[PLANE_PROP_IN_FORMATS]);
+    if (blob) {
+      int count = parse_in_formats(blob, formats);
+      drmModeFreePropertyBlob(blob);
+      return count;
+    }
+  }
+
+  drmModePlanePtr plane = find_plane(device, plane_id);
+  if (!plane) {
+    *formats = NULL;
+    return 0;
+  }
+
+  struct format_modifier *ret = calloc(plane->count_formats > 0 ? plane->count_formats : 1,
+    sizeof(*ret));
+  assert(ret);
+
+  for (uint32_t i = 0; i < plane->count_formats; i++) {
+    ret[i].format = plane->formats[i];
+    ret[i].modifier = DRM_FORMAT_MOD_LINEAR;
+  }
+
+  *formats = ret;
+  return plane->count_formats;
+}
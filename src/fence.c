@@ -0,0 +1,38 @@
+#include "fence.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/sync_file.h>
+
+int64_t fence_signal_nsec(int fd)
+{
+  struct sync_file_info info;
+  memset(&info, 0, sizeof(info));
+
+  if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) != 0 || info.status != 1 || info.num_fences == 0) {
+    return 0;
+  }
+
+  struct sync_fence_info *fences = calloc(info.num_fences, sizeof(*fences));
+  if (!fences) {
+    return 0;
+  }
+
+  info.sync_fence_info = (uint64_t)(uintptr_t)fences;
+
+  int64_t ret = 0;
+
+  // a merged fence signals with the last of its parts
+  if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) == 0) {
+    for (uint32_t i = 0; i < info.num_fences; i++) {
+      if ((int64_t)fences[i].timestamp_ns > ret) {
+        ret = fences[i].timestamp_ns;
+      }
+    }
+  }
+
+  free(fences);
+
+  return ret;
+}
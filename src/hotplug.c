@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+
+#include "hotplug.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+
+#include <libudev.h>
+#include <xf86drmMode.h>
+
+#include "device.h"
+
+static void *probe_run(void *data)
+{
+  struct hotplug *hotplug = data;
+
+  // signals are the main loop's to handle
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  for (;;) {
+    uint32_t connector_id;
+    ssize_t n = read(hotplug->request_fds[0], &connector_id, sizeof(connector_id));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    // the write end closes once hotplug_finish runs
+    if (n != sizeof(connector_id)) {
+      break;
+    }
+
+    drmModeConnectorPtr connector = drmModeGetConnector(hotplug->kms_fd, connector_id);
+    if (!connector) {
+      continue;
+    }
+
+    // smaller than PIPE_BUF, so never split
+    if (write(hotplug->result_fds[1], &connector, sizeof(connector)) != sizeof(connector)) {
+      drmModeFreeConnector(connector);
+    }
+  }
+
+  return NULL;
+}
+
+static bool start_probe_thread(struct hotplug *hotplug)
+{
+  if (pipe2(hotplug->request_fds, O_CLOEXEC) != 0) {
+    return false;
+  }
+
+  if (pipe2(hotplug->result_fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+    return false;
+  }
+
+  struct epoll_event event = { .events = EPOLLIN };
+  if (epoll_ctl(hotplug->epoll_fd, EPOLL_CTL_ADD, hotplug->result_fds[0], &event) != 0) {
+    return false;
+  }
+
+  hotplug->threaded = pthread_create(&hotplug->thread, NULL, probe_run, hotplug) == 0;
+  return hotplug->threaded;
+}
+
+bool hotplug_init(struct hotplug *hotplug, struct device *device)
+{
+  memset(hotplug, 0, sizeof(*hotplug));
+  hotplug->request_fds[0] = hotplug->request_fds[1] = -1;
+  hotplug->result_fds[0] = hotplug->result_fds[1] = -1;
+  hotplug->epoll_fd = -1;
+  hotplug->kms_fd = device->kms_fd;
+
+  struct stat st;
+  if (fstat(device->kms_fd, &st) != 0) {
+    fprintf(stderr, "Couldn't stat the KMS device: %s\n", strerror(errno));
+    return false;
+  }
+
+  hotplug->devnum = st.st_rdev;
+
+  hotplug->udev = udev_new();
+  if (!hotplug->udev) {
+    fprintf(stderr, "Couldn't create a udev context\n");
+    return false;
+  }
+
+  hotplug->monitor = udev_monitor_new_from_netlink(hotplug->udev, "udev");
+  if (!hotplug->monitor) {
+    fprintf(stderr, "Couldn't create a udev monitor\n");
+    goto err;
+  }
+
+  if (udev_monitor_filter_add_match_subsystem_devtype(hotplug->monitor, "drm", "drm_minor") < 0 ||
+    udev_monitor_enable_receiving(hotplug->monitor) < 0)
+  {
+    fprintf(stderr, "Couldn't listen for DRM uevents\n");
+    goto err;
+  }
+
+  hotplug->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = { .events = EPOLLIN };
+  if (hotplug->epoll_fd < 0 || epoll_ctl(hotplug->epoll_fd, EPOLL_CTL_ADD,
+    udev_monitor_get_fd(hotplug->monitor), &event) != 0)
+  {
+    fprintf(stderr, "Couldn't create an epoll set for hotplug events\n");
+    goto err;
+  }
+
+  if (!start_probe_thread(hotplug)) {
+    fprintf(stderr, "Couldn't start the connector probe thread, probing inline\n");
+  }
+
+  return true;
+
+err:
+  hotplug_finish(hotplug);
+  return false;
+}
+
+static void close_fd(int fd)
+{
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+void hotplug_finish(struct hotplug *hotplug)
+{
+  // waits for a probe still reading an EDID
+  close_fd(hotplug->request_fds[1]);
+  if (hotplug->threaded) {
+    pthread_join(hotplug->thread, NULL);
+  }
+
+  drmModeConnectorPtr connector;
+  while (hotplug->result_fds[0] >= 0 &&
+    read(hotplug->result_fds[0], &connector, sizeof(connector)) == sizeof(connector))
+  {
+    drmModeFreeConnector(connector);
+  }
+
+  close_fd(hotplug->request_fds[0]);
+  close_fd(hotplug->result_fds[0]);
+  close_fd(hotplug->result_fds[1]);
+  close_fd(hotplug->epoll_fd);
+
+  if (hotplug->monitor) {
+    udev_monitor_unref(hotplug->monitor);
+  }
+
+  if (hotplug->udev) {
+    udev_unref(hotplug->udev);
+  }
+
+  memset(hotplug, 0, sizeof(*hotplug));
+  hotplug->request_fds[0] = hotplug->request_fds[1] = -1;
+  hotplug->result_fds[0] = hotplug->result_fds[1] = -1;
+  hotplug->epoll_fd = -1;
+}
+
+int hotplug_fd(struct hotplug *hotplug)
+{
+  return hotplug->epoll_fd;
+}
+
+// hands the connector to the worker, or probes it right here without one
+static bool probe_connector(struct hotplug *hotplug, struct device *device,
+  uint32_t connector_id)
+{
+  if (hotplug->threaded &&
+    write(hotplug->request_fds[1], &connector_id, sizeof(connector_id)) == sizeof(connector_id))
+  {
+    return false;
+  }
+
+  drmModeConnectorPtr connector = drmModeGetConnector(device->kms_fd, connector_id);
+  if (!connector) {
+    return false;
+  }
+
+  bool added = device_add_output(device, connector);
+  drmModeFreeConnector(connector);
+
+  return added;
+}
+
+// the connector the event is about, 0 when the kernel doesn't say and every
+// connector has to be checked
+static uint32_t event_connector(struct udev_device *event)
+{
+  const char *connector = udev_device_get_property_value(event, "CONNECTOR");
+  return connector ? strtoul(connector, NULL, 10) : 0;
+}
+
+bool hotplug_dispatch(struct hotplug *hotplug, struct device *device)
+{
+  bool changed = false;
+
+  uint32_t *connected = calloc(device->res->count_connectors, sizeof(*connected));
+  assert(connected);
+  int num_connected;
+
+  struct udev_device *event;
+  while ((event = udev_monitor_receive_device(hotplug->monitor))) {
+    const char *action = udev_device_get_action(event);
+    const char *hotplug_prop = udev_device_get_property_value(event, "HOTPLUG");
+
+    if (udev_device_get_devnum(event) == hotplug->devnum &&
+      action && strcmp(action, "change") == 0 &&
+      hotplug_prop && strcmp(hotplug_prop, "1") == 0)
+    {
+      changed |= device_hotplug(device, event_connector(event), connected, &num_connected);
+
+      for (int i = 0; i < num_connected; i++) {
+        changed |= probe_connector(hotplug, device, connected[i]);
+      }
+    }
+
+    udev_device_unref(event);
+  }
+
+  free(connected);
+
+  drmModeConnectorPtr connector;
+  while (hotplug->result_fds[0] >= 0 &&
+    read(hotplug->result_fds[0], &connector, sizeof(connector)) == sizeof(connector))
+  {
+    changed |= device_add_output(device, connector);
+    drmModeFreeConnector(connector);
+  }
+
+  return changed;
+}
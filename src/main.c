@@ -1,11 +1,10 @@
-#include <stdio.h>
-
 #define _GNU_SOURCE
 
 #include <assert.h>
 #include <errno.h>
-#include <stdio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,15 +21,176 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "clock.h"
 #include "device.h"
+#include "hotplug.h"
+#include "output.h"
+#include "profiler.h"
+#include "telemetry.h"
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dump_telemetry = 0;
+
+static void handle_signal(int sig)
+{
+  (void)sig;
+  running = 0;
+}
+
+static void handle_dump_signal(int sig)
+{
+  (void)sig;
+  dump_telemetry = 1;
+}
+
+static void write_telemetry(struct device *device)
+{
+  size_t size = 0;
+  char *json = telemetry_json(device, &size);
+  if (json) {
+    fwrite(json, 1, size, stderr);
+    free(json);
+  }
+}
+
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+  unsigned int tv_usec, void *user_data)
+{
+  (void)fd;
+  (void)sequence;
+
+  struct output *output = user_data;
+
+  // time to first frame ends when the first frame reaches the screen
+  static bool first_flip = true;
+  if (first_flip) {
+    first_flip = false;
+    profiler_mark("first flip");
+    profiler_report();
+  }
+
+  int64_t flip_nsec = output->device->monotonic_timestamps ?
+    tv_sec * NSEC_PER_SEC + tv_usec * NSEC_PER_USEC : clock_now_nsec();
+
+  output_page_flip(output, flip_nsec);
+}
+
+// the KMS fd, one render timer per output, the telemetry socket and the
+// hotplug monitor, rebuilt whenever outputs come and go
+static struct pollfd *poll_fds(struct device *device, int telemetry_fd, int hotplug_fd,
+  int *num_fds)
+{
+  *num_fds = 3 + device->num_outputs;
+  struct pollfd *fds = calloc(*num_fds, sizeof(*fds));
+  assert(fds);
+
+  fds[0].fd = device->kms_fd;
+  fds[0].events = POLLIN;
+
+  for (int i = 0; i < device->num_outputs; i++) {
+    fds[1 + i].fd = device->outputs[i]->scheduler.timer_fd;
+    fds[1 + i].events = POLLIN;
+  }
+
+  // poll ignores negative fds, so a missing socket or monitor needs no
+  // special casing
+  fds[*num_fds - 2].fd = telemetry_fd;
+  fds[*num_fds - 2].events = POLLIN;
+  fds[*num_fds - 1].fd = hotplug_fd;
+  fds[*num_fds - 1].events = POLLIN;
+
+  return fds;
+}
+
+static void run(struct device *device)
+{
+  drmEventContext event_context = {0};
+  event_context.version = DRM_EVENT_CONTEXT_VERSION;
+  event_context.page_flip_handler = page_flip_handler;
+
+  int stage = profiler_begin("first frames");
+
+  for (int i = 0; i < device->num_outputs; i++) {
+    if (!output_repaint(device->outputs[i])) {
+      fprintf(stderr, "Failed to queue first frame for output %d\n",
+        device->outputs[i]->connector_id);
+    }
+  }
+
+  profiler_end(stage);
+
+  int telemetry_fd = telemetry_listen();
+
+  // without it the outputs found at startup are all there ever is
+  struct hotplug hotplug;
+  hotplug_init(&hotplug, device);
+
+  int num_fds;
+  struct pollfd *fds = poll_fds(device, telemetry_fd, hotplug_fd(&hotplug), &num_fds);
+
+  while (running) {
+    if (dump_telemetry) {
+      dump_telemetry = 0;
+      write_telemetry(device);
+    }
+
+    int ret = poll(fds, num_fds, -1);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      break;
+    }
+
+    if (fds[num_fds - 2].revents & POLLIN) {
+      telemetry_serve(device, telemetry_fd);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      drmHandleEvent(device->kms_fd, &event_context);
+    }
+
+    for (int i = 0; i < num_fds - 3; i++) {
+      if (fds[1 + i].revents & POLLIN) {
+        struct output *output = device->outputs[i];
+        scheduler_ack(&output->scheduler);
+
+        // each output runs its own timeline, a flip still pending here
+        // never holds up the others
+        if (!output->flip_pending) {
+          output_repaint(output);
+        }
+      }
+    }
+
+    // last, the timers above are indexed by the outputs as they were polled
+    if ((fds[num_fds - 1].revents & POLLIN) && hotplug_dispatch(&hotplug, device)) {
+      free(fds);
+      fds = poll_fds(device, telemetry_fd, hotplug_fd(&hotplug), &num_fds);
+    }
+  }
+
+  hotplug_finish(&hotplug);
+  telemetry_close(telemetry_fd);
+  free(fds);
+}
 
 int main() {
-  struct device *device = device_create();
+  profiler_init();
+
+  struct device *device = device_create(NULL);
   if (!device) {
     printf("Failed to get device\n");
     goto err_device;
   }
-  printf("got device %d", device->kms_fd);
+  printf("got device %d\n", device->kms_fd);
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGUSR1, handle_dump_signal);
+
+  run(device);
 
 err_device:
   return 0;
@@ -0,0 +1,197 @@
+#include "modifiers.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <drm_fourcc.h>
+#include <vulkan/vulkan.h>
+
+#include "buffer.h"
+#include "device.h"
+#include "drm_props.h"
+#include "vk_device.h"
+
+// rendered to, blitted into while compositing and blitted from as a layer
+static const VkFormatFeatureFlags required_features =
+  VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT |
+  VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+  VK_FORMAT_FEATURE_BLIT_DST_BIT;
+
+static int get_vk_modifiers(struct vk_device *vk_dev, VkFormat format,
+  VkDrmFormatModifierPropertiesEXT **modifiers)
+{
+  VkDrmFormatModifierPropertiesListEXT list = {0};
+  list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+
+  VkFormatProperties2 props = {0};
+  props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+  props.pNext = &list;
+
+  vkGetPhysicalDeviceFormatProperties2(vk_dev->physical_device, format, &props);
+
+  *modifiers = calloc(list.drmFormatModifierCount > 0 ? list.drmFormatModifierCount : 1,
+    sizeof(**modifiers));
+  assert(*modifiers);
+
+  list.pDrmFormatModifierProperties = *modifiers;
+  vkGetPhysicalDeviceFormatProperties2(vk_dev->physical_device, format, &props);
+
+  return list.drmFormatModifierCount;
+}
+
+// the compute compositor stores to frames through a UNORM view
+static bool vk_can_store(VkDrmFormatModifierPropertiesEXT *storage_modifiers,
+  int num_storage_modifiers, uint64_t modifier)
+{
+  for (int i = 0; i < num_storage_modifiers; i++) {
+    if (storage_modifiers[i].drmFormatModifier == modifier) {
+      return storage_modifiers[i].drmFormatModifierTilingFeatures &
+        VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+    }
+  }
+
+  return false;
+}
+
+static bool vk_can_import(struct vk_device *vk_dev, VkFormat format, uint64_t modifier)
+{
+  VkPhysicalDeviceImageDrmFormatModifierInfoEXT modifier_info = {0};
+  modifier_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
+  modifier_info.drmFormatModifier = modifier;
+  modifier_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VkPhysicalDeviceExternalImageFormatInfo external_info = {0};
+  external_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO;
+  external_info.pNext = &modifier_info;
+  external_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+  VkPhysicalDeviceImageFormatInfo2 info = {0};
+  info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+  info.pNext = &external_info;
+  info.format = format;
+  info.type = VK_IMAGE_TYPE_2D;
+  info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+  info.flags = buffer_image_flags(vk_dev);
+  info.usage = buffer_image_usage(vk_dev);
+
+  VkExternalImageFormatProperties external_props = {0};
+  external_props.sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES;
+
+  VkImageFormatProperties2 props = {0};
+  props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+  props.pNext = &external_props;
+
+  VkResult res = vkGetPhysicalDeviceImageFormatProperties2(vk_dev->physical_device,
+    &info, &props);
+  if (res != VK_SUCCESS) {
+    return false;
+  }
+
+  return external_props.externalMemoryProperties.externalMemoryFeatures &
+    VK_EXTERNAL_MEMORY_FEATURE_IMPORTABLE_BIT;
+}
+
+static void negotiate(struct device *device, struct modifier_set *set)
+{
+  struct vk_device *vk_dev = device->vk_device;
+
+  // layouts other than linear don't carry over to another device
+  if (vk_dev->prime) {
+    return;
+  }
+
+  VkFormat vk_format = vk_format_from_drm(set->format);
+  if (vk_format == VK_FORMAT_UNDEFINED) {
+    return;
+  }
+
+  struct format_modifier *plane_formats = NULL;
+  int num_plane_formats = drm_get_plane_formats(device, set->plane_id, &plane_formats);
+
+  VkDrmFormatModifierPropertiesEXT *vk_modifiers = NULL;
+  int num_vk_modifiers = get_vk_modifiers(vk_dev, vk_format, &vk_modifiers);
+
+  VkDrmFormatModifierPropertiesEXT *storage_modifiers = NULL;
+  int num_storage_modifiers = 0;
+  if (vk_dev->compute_composition) {
+    num_storage_modifiers = get_vk_modifiers(vk_dev, vk_storage_format_from_drm(set->format),
+      &storage_modifiers);
+  }
+
+  set->modifiers = calloc(num_plane_formats > 0 ? num_plane_formats : 1,
+    sizeof(*set->modifiers));
+  assert(set->modifiers);
+
+  for (int i = 0; i < num_plane_formats; i++) {
+    uint64_t modifier = plane_formats[i].modifier;
+
+    if (plane_formats[i].format != set->format || modifier == DRM_FORMAT_MOD_LINEAR ||
+      modifier == DRM_FORMAT_MOD_INVALID)
+    {
+      continue;
+    }
+
+    for (int j = 0; j < num_vk_modifiers; j++) {
+      VkDrmFormatModifierPropertiesEXT *props = &vk_modifiers[j];
+
+      if (props->drmFormatModifier != modifier ||
+        (props->drmFormatModifierTilingFeatures & required_features) != required_features ||
+        (vk_dev->compute_composition &&
+          !vk_can_store(storage_modifiers, num_storage_modifiers, modifier)) ||
+        !vk_can_import(vk_dev, vk_format, modifier))
+      {
+        continue;
+      }
+
+      set->modifiers[set->num_modifiers++] = modifier;
+      break;
+    }
+  }
+
+  free(storage_modifiers);
+  free(vk_modifiers);
+  free(plane_formats);
+}
+
+int modifiers_get(struct device *device, uint32_t plane_id, uint32_t format,
+  const uint64_t **modifiers)
+{
+  for (int i = 0; i < device->num_modifier_sets; i++) {
+    struct modifier_set *set = &device->modifier_sets[i];
+    if (set->plane_id == plane_id && set->format == format) {
+      *modifiers = set->modifiers;
+      return set->num_modifiers;
+    }
+  }
+
+  device->modifier_sets = realloc(device->modifier_sets,
+    (device->num_modifier_sets + 1) * sizeof(*device->modifier_sets));
+  assert(device->modifier_sets);
+
+  struct modifier_set *set = &device->modifier_sets[device->num_modifier_sets++];
+  set->plane_id = plane_id;
+  set->format = format;
+  set->modifiers = NULL;
+  set->num_modifiers = 0;
+
+  negotiate(device, set);
+
+  printf("Plane %d shares %d tiled modifiers for format 0x%08x\n", plane_id,
+    set->num_modifiers, format);
+
+  *modifiers = set->modifiers;
+  return set->num_modifiers;
+}
+
+void modifiers_finish(struct device *device)
+{
+  for (int i = 0; i < device->num_modifier_sets; i++) {
+    free(device->modifier_sets[i].modifiers);
+  }
+
+  free(device->modifier_sets);
+  device->modifier_sets = NULL;
+  device->num_modifier_sets = 0;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "output.h"
 
 #include <assert.h>
@@ -5,11 +7,24 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
+#include "buffer.h"
+#include "clock.h"
+#include "damage.h"
 #include "device.h"
+#include "drm_props.h"
+#include "fence.h"
+#include "plane_allocator.h"
+#include "render.h"
+#include "scene.h"
+#include "swapchain.h"
+#include "telemetry.h"
 
 static drmModeEncoderPtr find_encoder(struct device *device, drmModeConnectorPtr connector) {
   for (int i = 0; i < device->res->count_encoders; i++) {
@@ -39,42 +54,74 @@ static drmModeCrtcPtr find_crtc(struct device *device, drmModeEncoderPtr encoder
   return NULL;
 }
 
-static bool drm_is_primary_plane(struct device *device, uint32_t plane_id)
+static int crtc_index(struct device *device, uint32_t crtc_id)
 {
-  uint32_t p;
-  bool found = false;
-  bool ret = false;
-  drmModeObjectPropertiesPtr props =
-    drmModeObjectGetProperties(device->kms_fd, plane_id, DRM_MODE_OBJECT_PLANE);
-  if (!props) {
-    return false;
+  for (int i = 0; i < device->res->count_crtcs; i++) {
+    if (device->res->crtcs[i] == crtc_id) {
+      return i;
+    }
   }
-  for (p = 0; p < props->count_props && !found; p++) {
-    drmModePropertyPtr prop = drmModeGetProperty(device->kms_fd, props->props[p]);
-    if (prop) {
-      if (strcmp("type", prop->name) == 0) {
-        found = true;
-        ret = props->prop_values[p] == DRM_PLANE_TYPE_PRIMARY;
-      }
-      drmModeFreeProperty(prop);
+
+  return -1;
+}
+
+static bool plane_is_claimed(struct device *device, uint32_t plane_id)
+{
+  for (int i = 0; i < device->num_outputs; i++) {
+    if (device->outputs[i]->primary_plane_id == plane_id) {
+      return true;
     }
   }
-  drmModeFreeObjectProperties(props);
-  return ret;
+
+  // still scanning out until their disable commit lands
+  for (int i = 0; i < device->num_removed_outputs; i++) {
+    if (device->removed_outputs[i]->primary_plane_id == plane_id) {
+      return true;
+    }
+  }
+
+  return false;
 }
 
-static drmModePlanePtr find_primary_plane(struct device *device) {
+static drmModePlanePtr find_primary_plane(struct device *device, uint32_t crtc_id) {
+  int index = crtc_index(device, crtc_id);
+  if (index < 0) {
+    printf("CRTC %d is not part of the device resources\n", crtc_id);
+    return NULL;
+  }
+
+  drmModePlanePtr ret = NULL;
+
   for (int p = 0; p < device->num_planes; p++) {
     drmModePlanePtr plane = device->planes[p];
-    int is_plane = drm_is_primary_plane(device, plane->plane_id);
-    if (is_plane) {
+
+    if (!(plane->possible_crtcs & (1u << index))) {
+      continue;
+    }
+
+    if (plane_is_claimed(device, plane->plane_id)) {
+      continue;
+    }
+
+    if (!drm_is_primary_plane(device, plane->plane_id)) {
+      continue;
+    }
+
+    // prefer the plane already scanning out on this CRTC
+    if (plane->crtc_id == crtc_id) {
       return plane;
     }
+
+    if (!ret) {
+      ret = plane;
+    }
   }
 
-  printf("Could not find primary plan\n");
+  if (!ret) {
+    printf("Could not find primary plane for CRTC %d\n", crtc_id);
+  }
 
-  return NULL;
+  return ret;
 }
 
 struct output* output_new(
@@ -92,8 +139,12 @@ struct output* output_new(
   ret->primary_plane_id = primary_plane_id;
   ret->crtc_id = crtc_id;
   ret->connector_id = connector_id;
-  ret->mode_info = mode_info;
+  ret->mode_info = *mode_info;
   ret->refresh_nsec = refresh_nsec;
+  ret->render_fence_fd = -1;
+
+  // nothing has been drawn yet
+  damage_add_rect(&ret->damage, 0, 0, mode_info->hdisplay, mode_info->vdisplay);
 
   return ret;
 }
@@ -104,6 +155,103 @@ static int64_t millihz_to_nsec(uint32_t mhz)
   return 1000000000000LL / mhz;
 }
 
+// turns on variable refresh when the connector and CRTC support it and the
+// driver accepts it without a modeset
+static bool output_enable_vrr(struct output *output)
+{
+  struct device *device = output->device;
+
+  const struct connector_props *connector_props =
+    drm_connector_props(device, output->connector_id);
+  if (!connector_props || !connector_props->ids[CONNECTOR_PROP_VRR_CAPABLE] ||
+    !connector_props->values[CONNECTOR_PROP_VRR_CAPABLE])
+  {
+    return false;
+  }
+
+  uint32_t vrr_enabled = output->crtc_props->ids[CRTC_PROP_VRR_ENABLED];
+  if (!vrr_enabled) {
+    return false;
+  }
+
+  drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+  assert(req);
+
+  drmModeAtomicAddProperty(req, output->crtc_id, vrr_enabled, 1);
+  int err = drmModeAtomicCommit(device->kms_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+
+  drmModeAtomicFree(req);
+
+  if (err != 0) {
+    printf("Output %d can't enable variable refresh: %s\n", output->connector_id,
+      strerror(-err));
+    return false;
+  }
+
+  printf("Variable refresh enabled on output %d\n", output->connector_id);
+  return true;
+}
+
+// everything output_create and output_create_modeset share, once a CRTC,
+// primary plane and mode are picked
+static struct output *output_setup(struct device *device, uint32_t connector_id,
+  uint32_t crtc_id, uint32_t primary_plane_id, drmModeModeInfoPtr mode)
+{
+  uint64_t refresh_millihz = ((mode->clock * 1000000LL / mode->htotal) +
+    (mode->vtotal / 2)) / mode->vtotal;
+
+  int64_t refresh_nsec = millihz_to_nsec(refresh_millihz);
+
+  struct output *ret = output_new(
+    device,
+    primary_plane_id,
+    crtc_id,
+    connector_id,
+    mode,
+    refresh_nsec);
+
+  assert(ret);
+
+  scene_init(&ret->scene);
+  telemetry_init(&ret->telemetry, ret->refresh_nsec);
+
+  // something to look at until there is real content
+  struct quad_instance *quad = scene_add_quad(&ret->scene, VK_NULL_HANDLE, 0);
+  quad->rect[0] = ret->mode_info.hdisplay / 4.f;
+  quad->rect[1] = ret->mode_info.vdisplay / 4.f;
+  quad->rect[2] = ret->mode_info.hdisplay / 2.f;
+  quad->rect[3] = ret->mode_info.vdisplay / 2.f;
+  quad->uv[2] = 1.f;
+  quad->uv[3] = 1.f;
+  quad->color[0] = 1.f;
+  quad->color[3] = 1.f;
+
+  ret->primary_plane_props = drm_plane_props(device, ret->primary_plane_id);
+  ret->crtc_props = drm_crtc_props(device, ret->crtc_id);
+  ret->connector_props = drm_connector_props(device, ret->connector_id);
+  assert(ret->primary_plane_props && ret->crtc_props);
+
+  // connectors that appeared after the device was opened, like MST ones,
+  // have no properties resolved
+  if (!ret->connector_props ||
+    !drm_plane_props_usable(ret->primary_plane_props) ||
+    !drm_crtc_props_usable(ret->crtc_props) ||
+    !plane_allocator_init(&ret->planes, ret) ||
+    !scheduler_init(&ret->scheduler, ret->refresh_nsec))
+  {
+    plane_allocator_finish(&ret->planes);
+    scene_finish(&ret->scene);
+    free(ret);
+    return NULL;
+  }
+
+  ret->vrr = output_enable_vrr(ret);
+  scheduler_set_vrr(&ret->scheduler, ret->vrr);
+  ret->telemetry.vrr = ret->vrr;
+
+  return ret;
+}
+
 struct output *output_create(struct device *device, drmModeConnectorPtr connector)
 {
   struct output *ret = NULL;
@@ -129,23 +277,13 @@ struct output *output_create(struct device *device, drmModeConnectorPtr connecto
     goto err_crtc;
   }
 
-  drmModePlanePtr primary_plane = find_primary_plane(device);
-  assert(primary_plane);
-
-  uint64_t refresh_millihz = ((crtc->mode.clock * 1000000LL / crtc->mode.htotal) +
-    (crtc->mode.vtotal / 2)) / crtc->mode.vtotal;
-
-  int64_t refresh_nsec = millihz_to_nsec(refresh_millihz);
-
-  ret = output_new(
-    device,
-    primary_plane->plane_id,
-    crtc->crtc_id,
-    connector->connector_id,
-    &crtc->mode,
-    refresh_nsec);
+  drmModePlanePtr primary_plane = find_primary_plane(device, crtc->crtc_id);
+  if (!primary_plane) {
+    goto err_crtc;
+  }
 
-  assert(ret);
+  ret = output_setup(device, connector->connector_id, crtc->crtc_id, primary_plane->plane_id,
+    &crtc->mode);
 
 err_crtc:
   drmModeFreeCrtc(crtc);
@@ -155,3 +293,591 @@ err_encoder:
 
   return ret;
 }
+
+static bool crtc_is_claimed(struct device *device, uint32_t crtc_id)
+{
+  for (int i = 0; i < device->num_outputs; i++) {
+    if (device->outputs[i]->crtc_id == crtc_id) {
+      return true;
+    }
+  }
+
+  for (int i = 0; i < device->num_removed_outputs; i++) {
+    if (device->removed_outputs[i]->crtc_id == crtc_id) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// first CRTC one of the connector's encoders can drive that no output uses
+static uint32_t pick_crtc(struct device *device, drmModeConnectorPtr connector)
+{
+  for (int e = 0; e < connector->count_encoders; e++) {
+    drmModeEncoderPtr encoder = drmModeGetEncoder(device->kms_fd, connector->encoders[e]);
+    if (!encoder) {
+      continue;
+    }
+
+    uint32_t possible_crtcs = encoder->possible_crtcs;
+    drmModeFreeEncoder(encoder);
+
+    for (int i = 0; i < device->res->count_crtcs; i++) {
+      uint32_t crtc_id = device->res->crtcs[i];
+
+      if ((possible_crtcs & (1u << i)) && !crtc_is_claimed(device, crtc_id)) {
+        return crtc_id;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static drmModeModeInfoPtr preferred_mode(drmModeConnectorPtr connector)
+{
+  for (int i = 0; i < connector->count_modes; i++) {
+    if (connector->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+      return &connector->modes[i];
+    }
+  }
+
+  return &connector->modes[0];
+}
+
+struct output *output_create_modeset(struct device *device, drmModeConnectorPtr connector)
+{
+  if (connector->connection != DRM_MODE_CONNECTED || connector->count_modes == 0) {
+    printf("Connector %d has no modes\n", connector->connector_id);
+    return NULL;
+  }
+
+  uint32_t crtc_id = pick_crtc(device, connector);
+  if (crtc_id == 0) {
+    printf("No free CRTC for connector %d\n", connector->connector_id);
+    return NULL;
+  }
+
+  drmModePlanePtr primary_plane = find_primary_plane(device, crtc_id);
+  if (!primary_plane) {
+    return NULL;
+  }
+
+  drmModeModeInfoPtr mode = preferred_mode(connector);
+
+  struct output *ret = output_setup(device, connector->connector_id, crtc_id,
+    primary_plane->plane_id, mode);
+  if (!ret) {
+    return NULL;
+  }
+
+  if (!ret->crtc_props->ids[CRTC_PROP_ACTIVE] || !ret->crtc_props->ids[CRTC_PROP_MODE_ID] ||
+    !ret->connector_props->ids[CONNECTOR_PROP_CRTC_ID])
+  {
+    printf("CRTC %d can't be set up with atomic commits\n", crtc_id);
+    goto err;
+  }
+
+  if (drmModeCreatePropertyBlob(device->kms_fd, mode, sizeof(*mode), &ret->mode_blob_id) != 0) {
+    fprintf(stderr, "Couldn't create a mode blob for connector %d\n", connector->connector_id);
+    goto err;
+  }
+
+  ret->modeset = true;
+
+  printf("Lighting up connector %d with %s on CRTC %d\n", connector->connector_id,
+    mode->name, crtc_id);
+
+  return ret;
+
+err:
+  output_destroy(ret);
+  return NULL;
+}
+
+void output_destroy(struct output *output)
+{
+  if (output->swapchain) {
+    swapchain_destroy(output->swapchain);
+  }
+
+  if (output->mode_blob_id) {
+    drmModeDestroyPropertyBlob(output->device->kms_fd, output->mode_blob_id);
+  }
+
+  if (output->render_fence_fd >= 0) {
+    close(output->render_fence_fd);
+  }
+
+  plane_allocator_finish(&output->planes);
+  scheduler_finish(&output->scheduler);
+  scene_finish(&output->scene);
+  free(output);
+}
+
+// switches the output off without waiting for it, the flip event of the
+// commit frees it
+static bool output_disable(struct output *output)
+{
+  drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+  assert(req);
+
+  const uint32_t *plane_ids = output->primary_plane_props->ids;
+  const uint32_t *crtc_ids = output->crtc_props->ids;
+
+  plane_allocator_clear(&output->planes, req);
+  drmModeAtomicAddProperty(req, output->primary_plane_id, plane_ids[PLANE_PROP_FB_ID], 0);
+  drmModeAtomicAddProperty(req, output->primary_plane_id, plane_ids[PLANE_PROP_CRTC_ID], 0);
+
+  if (crtc_ids[CRTC_PROP_ACTIVE] && crtc_ids[CRTC_PROP_MODE_ID]) {
+    drmModeAtomicAddProperty(req, output->crtc_id, crtc_ids[CRTC_PROP_ACTIVE], 0);
+    drmModeAtomicAddProperty(req, output->crtc_id, crtc_ids[CRTC_PROP_MODE_ID], 0);
+  }
+
+  if (output->connector_props->ids[CONNECTOR_PROP_CRTC_ID]) {
+    drmModeAtomicAddProperty(req, output->connector_id,
+      output->connector_props->ids[CONNECTOR_PROP_CRTC_ID], 0);
+  }
+
+  // blocking here would hold up the flips of every other output
+  int err = drmModeAtomicCommit(output->device->kms_fd, req,
+    DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET, output);
+
+  drmModeAtomicFree(req);
+
+  if (err != 0) {
+    fprintf(stderr, "Couldn't switch off output %d: %s\n", output->connector_id,
+      strerror(-err));
+    return false;
+  }
+
+  // the CRTC going off frees what the others share
+  device_invalidate_plane_caches(output->device);
+
+  output->disabled = true;
+  output->flip_pending = true;
+  return true;
+}
+
+void output_remove(struct output *output)
+{
+  output->removed = true;
+
+  // a nonblocking commit can't go out while a flip is in flight, it follows
+  // once that lands
+  if (output->flip_pending) {
+    return;
+  }
+
+  // removing the framebuffers takes what is left on screen down with them
+  if (!output_disable(output)) {
+    device_destroy_removed_output(output->device, output);
+  }
+}
+
+// shows the source region of a framebuffer across the whole output
+static void output_set_primary(struct output *output, drmModeAtomicReqPtr req,
+  struct buffer *buffer, uint32_t src_x, uint32_t src_y)
+{
+  const uint32_t *ids = output->primary_plane_props->ids;
+  uint32_t plane_id = output->primary_plane_id;
+  uint32_t width = output->mode_info.hdisplay;
+  uint32_t height = output->mode_info.vdisplay;
+
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_FB_ID], buffer->fb_id);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_ID], output->crtc_id);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_SRC_X], (uint64_t)src_x << 16);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_SRC_Y], (uint64_t)src_y << 16);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_SRC_W], (uint64_t)width << 16);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_SRC_H], (uint64_t)height << 16);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_X], 0);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_Y], 0);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_W], width);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_H], height);
+
+  struct plane_cache_plane plane;
+  plane_cache_plane_init(&plane, plane_id, output->crtc_id, buffer);
+  plane.src_x = src_x;
+  plane.src_y = src_y;
+  plane.src_w = width;
+  plane.src_h = height;
+  plane.crtc_w = width;
+  plane.crtc_h = height;
+
+  output->planes.primary_key = plane_cache_key(PLANE_CACHE_SEED, &plane);
+}
+
+static void output_add_primary(struct output *output, drmModeAtomicReqPtr req,
+  struct buffer *buffer)
+{
+  output_set_primary(output, req, buffer, 0, 0);
+}
+
+// keeps the CRTC on the output's mode and connector, a no-op for the driver
+// when that is what it already shows
+static void output_add_routing(struct output *output, drmModeAtomicReqPtr req)
+{
+  const uint32_t *crtc_ids = output->crtc_props->ids;
+
+  drmModeAtomicAddProperty(req, output->crtc_id, crtc_ids[CRTC_PROP_MODE_ID],
+    output->mode_blob_id);
+  drmModeAtomicAddProperty(req, output->crtc_id, crtc_ids[CRTC_PROP_ACTIVE], 1);
+  drmModeAtomicAddProperty(req, output->connector_id,
+    output->connector_props->ids[CONNECTOR_PROP_CRTC_ID], output->crtc_id);
+}
+
+void output_takeover(struct output *output)
+{
+  int kms_fd = output->device->kms_fd;
+
+  // without the properties the first frame is a bare flip, as it always was
+  if (!output->crtc_props->ids[CRTC_PROP_ACTIVE] || !output->crtc_props->ids[CRTC_PROP_MODE_ID] ||
+    !output->connector_props->ids[CONNECTOR_PROP_CRTC_ID])
+  {
+    return;
+  }
+
+  if (drmModeCreatePropertyBlob(kms_fd, &output->mode_info, sizeof(output->mode_info),
+    &output->mode_blob_id) != 0)
+  {
+    fprintf(stderr, "Couldn't create a mode blob for output %d\n", output->connector_id);
+    output->mode_blob_id = 0;
+    return;
+  }
+
+  drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+  assert(req);
+
+  output_add_primary(output, req, output->swapchain->buffers[0]);
+  output_add_routing(output, req);
+
+  // a full modeset blanks the panel for hundreds of milliseconds
+  int err = drmModeAtomicCommit(kms_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+  if (err == 0) {
+    printf("Taking over output %d without a modeset\n", output->connector_id);
+    drmModeAtomicFree(req);
+    return;
+  }
+
+  int modeset_err = drmModeAtomicCommit(kms_fd, req,
+    DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+  if (modeset_err == 0) {
+    printf("Taking over output %d needs a modeset: %s\n", output->connector_id,
+      strerror(-err));
+    output->modeset = true;
+  } else {
+    // routing the driver rejected either way would fail every first commit,
+    // a bare flip at least stands a chance
+    fprintf(stderr, "Output %d can't keep its mode %s: %s\n", output->connector_id,
+      output->mode_info.name, strerror(-modeset_err));
+    drmModeDestroyPropertyBlob(kms_fd, output->mode_blob_id);
+    output->mode_blob_id = 0;
+  }
+
+  drmModeAtomicFree(req);
+}
+
+// commits a frame rendered into buffer, or one without GPU work when buffer
+// is NULL and render_fence_fd is -1
+static bool output_commit(struct output *output, drmModeAtomicReqPtr req,
+  struct buffer *buffer, int render_fence_fd)
+{
+  int kms_fd = output->device->kms_fd;
+
+  // written by the kernel, signalled once the previous front buffer is released
+  int32_t out_fence_fd = -1;
+
+  const uint32_t *plane_ids = output->primary_plane_props->ids;
+
+  if (render_fence_fd >= 0) {
+    drmModeAtomicAddProperty(req, output->primary_plane_id,
+      plane_ids[PLANE_PROP_IN_FENCE_FD], render_fence_fd);
+  }
+  drmModeAtomicAddProperty(req, output->crtc_id, output->crtc_props->ids[CRTC_PROP_OUT_FENCE_PTR],
+    (uint64_t)(uintptr_t)&out_fence_fd);
+
+  // the first commit switches it on, the ones after are no-ops for the driver
+  if (output->vrr) {
+    drmModeAtomicAddProperty(req, output->crtc_id,
+      output->crtc_props->ids[CRTC_PROP_VRR_ENABLED], 1);
+  }
+
+  // lets drivers with self refresh panels or manual update displays only
+  // send what changed over the link. Damage is in output coordinates, which
+  // only match the framebuffer's for our own buffers, a client buffer
+  // scanned out directly is left fully damaged.
+  uint32_t damage_blob_id = 0;
+  if (buffer && plane_ids[PLANE_PROP_FB_DAMAGE_CLIPS] &&
+    drmModeCreatePropertyBlob(kms_fd, output->damage.rects,
+      output->damage.num_rects * sizeof(output->damage.rects[0]), &damage_blob_id) == 0)
+  {
+    drmModeAtomicAddProperty(req, output->primary_plane_id,
+      plane_ids[PLANE_PROP_FB_DAMAGE_CLIPS], damage_blob_id);
+  }
+
+  uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+
+  // a hotplugged output lights up along with its first frame, a taken over
+  // one keeps what the firmware set up
+  if (output->mode_blob_id) {
+    output_add_routing(output, req);
+  }
+  if (output->modeset) {
+    flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+  }
+
+  int err = drmModeAtomicCommit(kms_fd, req, flags, output);
+
+  // the commit holds its own reference
+  if (damage_blob_id) {
+    drmModeDestroyPropertyBlob(kms_fd, damage_blob_id);
+  }
+
+  if (err != 0) {
+    fprintf(stderr, "Atomic commit failed for output %d: %s\n",
+      output->connector_id, strerror(-err));
+    // a cached configuration the driver turned down now, after another CRTC
+    // lit up say, would otherwise fail the same way every frame
+    plane_allocator_invalidate(&output->planes);
+    return false;
+  }
+
+  // the CRTC holds its own reference to the mode
+  if (output->mode_blob_id) {
+    drmModeDestroyPropertyBlob(kms_fd, output->mode_blob_id);
+    output->mode_blob_id = 0;
+  }
+
+  // configurations tested before the modeset were checked against the old
+  // CRTC state
+  if (output->modeset) {
+    device_invalidate_plane_caches(output->device);
+    output->modeset = false;
+  }
+
+  if (buffer) {
+    swapchain_queue(output->swapchain, buffer, out_fence_fd, &output->damage);
+  } else {
+    swapchain_bypass(output->swapchain, out_fence_fd);
+  }
+  plane_allocator_commit(&output->planes);
+  output->flip_pending = true;
+
+  return true;
+}
+
+void output_damage(struct output *output, int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+  bool idle = damage_is_empty(&output->damage);
+
+  damage_add_rect(&output->damage, x1, y1, x2, y2);
+  damage_clip(&output->damage, output->mode_info.hdisplay, output->mode_info.vdisplay);
+
+  // a pending flip arms the timer itself once it lands
+  if (idle && !output->flip_pending) {
+    scheduler_wake(&output->scheduler);
+  }
+}
+
+void output_damage_whole(struct output *output)
+{
+  output_damage(output, 0, 0, output->mode_info.hdisplay, output->mode_info.vdisplay);
+}
+
+static bool format_has_alpha(uint32_t format)
+{
+  switch (format) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_RGBA8888:
+    case DRM_FORMAT_BGRA8888:
+    case DRM_FORMAT_ARGB2101010:
+    case DRM_FORMAT_ABGR2101010:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// an opaque bottom layer covering the whole output at 1:1 hides the output's
+// own rendering, so the primary plane can show it instead of a copy of it
+static struct layer *scanout_candidate(struct output *output)
+{
+  struct scene *scene = &output->scene;
+  if (scene->num_layers == 0) {
+    return NULL;
+  }
+
+  struct layer *layer = &scene->layers[0];
+  struct buffer *buffer = layer->buffer;
+
+  if (!buffer || buffer->fb_id == 0 || format_has_alpha(buffer->dmabuf.format)) {
+    return NULL;
+  }
+
+  if (layer->x != 0 || layer->y != 0 ||
+    layer->width != output->mode_info.hdisplay || layer->height != output->mode_info.vdisplay ||
+    layer->src_w != layer->width || layer->src_h != layer->height ||
+    layer->src_x + layer->src_w > buffer->dmabuf.width ||
+    layer->src_y + layer->src_h > buffer->dmabuf.height)
+  {
+    return NULL;
+  }
+
+  return layer;
+}
+
+// puts the bottom layer on the primary plane and everything above it on
+// overlays, skipping the GPU entirely. False when KMS can't take all of it.
+static bool output_scanout_direct(struct output *output)
+{
+  struct layer *layer = scanout_candidate(output);
+  if (!layer) {
+    return false;
+  }
+
+  drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+  assert(req);
+
+  // overlays still on screen would otherwise be part of the test
+  plane_allocator_clear(&output->planes, req);
+  output_set_primary(output, req, layer->buffer, layer->src_x, layer->src_y);
+
+  if (!plane_allocator_test_primary(&output->planes, req)) {
+    goto err_req;
+  }
+
+  if (plane_allocator_assign(&output->planes, req, &output->scene, 1) > 0) {
+    goto err_req;
+  }
+
+  if (!output_commit(output, req, NULL, -1)) {
+    goto err_req;
+  }
+
+  layer->plane_id = output->primary_plane_id;
+  drmModeAtomicFree(req);
+
+  return true;
+
+err_req:
+  drmModeAtomicFree(req);
+  return false;
+}
+
+bool output_repaint(struct output *output)
+{
+  // nothing changed, stay idle until output_damage wakes us up
+  if (damage_is_empty(&output->damage)) {
+    telemetry_idle(&output->telemetry);
+    return true;
+  }
+
+  memset(&output->frame, 0, sizeof(output->frame));
+  output->frame.start_nsec = clock_now_nsec();
+
+  if (output_scanout_direct(output)) {
+    damage_clear(&output->damage);
+    output->frame.commit_nsec = clock_now_nsec();
+    return true;
+  }
+
+  // the GPU is still busy with earlier frames of this output, try again a
+  // frame later rather than blocking every other output's timeline
+  struct buffer *buffer = swapchain_acquire(output->swapchain);
+  if (!buffer) {
+    scheduler_defer(&output->scheduler);
+    return false;
+  }
+
+  drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+  assert(req);
+
+  output_add_primary(output, req, buffer);
+
+  // decided before rendering, the GPU only draws the layers KMS can't take
+  plane_allocator_assign(&output->planes, req, &output->scene, 0);
+
+  struct damage buffer_damage;
+  swapchain_buffer_damage(output->swapchain, buffer, &output->damage, &buffer_damage);
+
+  int render_fence_fd;
+  if (!render_frame(output, buffer, &buffer_damage, &render_fence_fd)) {
+    goto err_req;
+  }
+
+  // KMS waits for rendering to finish, so this commits before the GPU is done
+  if (!output_commit(output, req, buffer, render_fence_fd)) {
+    if (render_fence_fd >= 0) {
+      close(render_fence_fd);
+    }
+    goto err_req;
+  }
+
+  drmModeAtomicFree(req);
+
+  damage_clear(&output->damage);
+
+  output->frame.commit_nsec = clock_now_nsec();
+
+  if (output->render_fence_fd >= 0) {
+    close(output->render_fence_fd);
+  }
+  output->render_fence_fd = render_fence_fd;
+
+  return true;
+
+err_req:
+  drmModeAtomicFree(req);
+  scheduler_defer(&output->scheduler);
+  return false;
+}
+
+static void output_measure_frame(struct output *output)
+{
+  if (output->render_fence_fd < 0) {
+    return;
+  }
+
+  // the flip waited for the fence, so it has signalled by now
+  int64_t done_nsec = fence_signal_nsec(output->render_fence_fd);
+
+  close(output->render_fence_fd);
+  output->render_fence_fd = -1;
+
+  if (done_nsec == 0) {
+    return;
+  }
+
+  output->frame.gpu_done_nsec = done_nsec;
+
+  if (output->frame.commit_nsec > done_nsec) {
+    done_nsec = output->frame.commit_nsec;
+  }
+
+  scheduler_add_sample(&output->scheduler, done_nsec - output->frame.start_nsec);
+}
+
+void output_page_flip(struct output *output, int64_t flip_nsec)
+{
+  output->flip_pending = false;
+
+  // nothing of the output is on screen once its disable commit has landed
+  if (output->removed) {
+    if (!output->disabled && output_disable(output)) {
+      return;
+    }
+
+    device_destroy_removed_output(output->device, output);
+    return;
+  }
+
+  output_measure_frame(output);
+
+  output->frame.flip_nsec = flip_nsec;
+  telemetry_frame(&output->telemetry, &output->frame);
+
+  // rendering starts when the scheduler's timer fires
+  scheduler_flip(&output->scheduler, flip_nsec);
+}
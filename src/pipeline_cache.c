@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+
+#include "pipeline_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <vulkan/vulkan.h>
+
+#include "vk_device.h"
+
+#define PIPELINE_CACHE_MAGIC 0x43584647  // 'GFXC'
+#define PIPELINE_CACHE_VERSION 1
+#define PIPELINE_CACHE_DIR "gfx"
+#define PIPELINE_CACHE_FILE "pipeline-cache"
+
+// prepended to the vulkan cache blob, which itself only carries the
+// pipeline cache UUID and not the driver version
+struct pipeline_cache_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t vendor_id;
+  uint32_t device_id;
+  uint32_t driver_version;
+  uint8_t uuid[VK_UUID_SIZE];
+  uint64_t data_size;
+};
+
+static bool cache_dir(char *path, size_t size)
+{
+  const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  int len;
+  if (xdg_cache_home && xdg_cache_home[0] == '/') {
+    len = snprintf(path, size, "%s/%s", xdg_cache_home, PIPELINE_CACHE_DIR);
+  } else if (home && home[0] == '/') {
+    len = snprintf(path, size, "%s/.cache/%s", home, PIPELINE_CACHE_DIR);
+  } else {
+    return false;
+  }
+
+  return len > 0 && (size_t)len < size;
+}
+
+static bool cache_path(char *path, size_t size)
+{
+  char dir[PATH_MAX];
+  if (!cache_dir(dir, sizeof(dir))) {
+    return false;
+  }
+
+  int len = snprintf(path, size, "%s/%s", dir, PIPELINE_CACHE_FILE);
+  return len > 0 && (size_t)len < size;
+}
+
+static bool make_dirs(const char *path)
+{
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s", path);
+
+  for (char *p = tmp + 1; *p; p++) {
+    if (*p != '/') {
+      continue;
+    }
+    *p = '\0';
+    if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    *p = '/';
+  }
+
+  return mkdir(tmp, 0755) == 0 || errno == EEXIST;
+}
+
+static void fill_header(struct vk_device *vk_dev, struct pipeline_cache_header *header)
+{
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(vk_dev->physical_device, &props);
+
+  memset(header, 0, sizeof(*header));
+  header->magic = PIPELINE_CACHE_MAGIC;
+  header->version = PIPELINE_CACHE_VERSION;
+  header->vendor_id = props.vendorID;
+  header->device_id = props.deviceID;
+  header->driver_version = props.driverVersion;
+  memcpy(header->uuid, props.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+static void *read_cache(struct vk_device *vk_dev, const char *path, size_t *size)
+{
+  void *data = NULL;
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+
+  struct pipeline_cache_header expected;
+  fill_header(vk_dev, &expected);
+
+  struct pipeline_cache_header header;
+  if (fread(&header, sizeof(header), 1, file) != 1) {
+    goto out;
+  }
+
+  if (header.magic != expected.magic ||
+    header.version != expected.version ||
+    header.vendor_id != expected.vendor_id ||
+    header.device_id != expected.device_id ||
+    header.driver_version != expected.driver_version ||
+    memcmp(header.uuid, expected.uuid, VK_UUID_SIZE) != 0)
+  {
+    printf("Ignoring pipeline cache from a different device or driver\n");
+    goto out;
+  }
+
+  if (header.data_size == 0 || header.data_size > SIZE_MAX) {
+    goto out;
+  }
+
+  data = malloc(header.data_size);
+  if (!data) {
+    goto out;
+  }
+
+  if (fread(data, header.data_size, 1, file) != 1) {
+    free(data);
+    data = NULL;
+    goto out;
+  }
+
+  *size = header.data_size;
+
+out:
+  fclose(file);
+  return data;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+  const uint8_t *p = data;
+
+  while (size > 0) {
+    ssize_t written = write(fd, p, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+bool pipeline_cache_load(struct vk_device *vk_dev)
+{
+  size_t size = 0;
+  void *data = NULL;
+
+  char path[PATH_MAX];
+  if (cache_path(path, sizeof(path))) {
+    data = read_cache(vk_dev, path, &size);
+  }
+
+  VkPipelineCacheCreateInfo info = {0};
+  info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  info.initialDataSize = size;
+  info.pInitialData = data;
+
+  VkResult res = vkCreatePipelineCache(vk_dev->device, &info, NULL, &vk_dev->pipeline_cache);
+
+  if (res != VK_SUCCESS && data) {
+    // the driver rejected the blob, start over empty
+    size = 0;
+    info.initialDataSize = 0;
+    info.pInitialData = NULL;
+    res = vkCreatePipelineCache(vk_dev->device, &info, NULL, &vk_dev->pipeline_cache);
+  }
+
+  free(data);
+
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreatePipelineCache failed: %d\n", res);
+    vk_dev->pipeline_cache = VK_NULL_HANDLE;
+    return false;
+  }
+
+  vk_dev->pipeline_cache_size = size;
+
+  printf("Loaded %zu bytes of pipeline cache\n", size);
+
+  return true;
+}
+
+void pipeline_cache_store(struct vk_device *vk_dev)
+{
+  VkResult res;
+
+  if (!vk_dev->pipeline_cache) {
+    return;
+  }
+
+  size_t size = 0;
+  res = vkGetPipelineCacheData(vk_dev->device, vk_dev->pipeline_cache, &size, NULL);
+  if (res != VK_SUCCESS || size == 0) {
+    return;
+  }
+
+  // nothing new was compiled since the cache was loaded
+  if (size == vk_dev->pipeline_cache_size) {
+    return;
+  }
+
+  void *data = malloc(size);
+  if (!data) {
+    return;
+  }
+
+  res = vkGetPipelineCacheData(vk_dev->device, vk_dev->pipeline_cache, &size, data);
+  if (res != VK_SUCCESS) {
+    goto out;
+  }
+
+  char dir[PATH_MAX];
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX + 32];
+
+  if (!cache_dir(dir, sizeof(dir)) || !cache_path(path, sizeof(path))) {
+    goto out;
+  }
+
+  if (!make_dirs(dir)) {
+    fprintf(stderr, "Couldn't create %s: %s\n", dir, strerror(errno));
+    goto out;
+  }
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't open %s: %s\n", tmp_path, strerror(errno));
+    goto out;
+  }
+
+  struct pipeline_cache_header header;
+  fill_header(vk_dev, &header);
+  header.data_size = size;
+
+  // readers either see the old cache or the complete new one
+  bool ok = write_all(fd, &header, sizeof(header)) &&
+    write_all(fd, data, size) &&
+    fsync(fd) == 0;
+
+  close(fd);
+
+  if (!ok || rename(tmp_path, path) != 0) {
+    fprintf(stderr, "Couldn't write pipeline cache %s: %s\n", path, strerror(errno));
+    unlink(tmp_path);
+    goto out;
+  }
+
+  vk_dev->pipeline_cache_size = size;
+
+  printf("Stored %zu bytes of pipeline cache\n", size);
+
+out:
+  free(data);
+}
@@ -0,0 +1,386 @@
+#include "plane_allocator.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "buffer.h"
+#include "device.h"
+#include "output.h"
+#include "scene.h"
+
+static uint32_t crtc_mask(struct device *device, uint32_t crtc_id)
+{
+  for (int i = 0; i < device->res->count_crtcs; i++) {
+    if (device->res->crtcs[i] == crtc_id) {
+      return 1u << i;
+    }
+  }
+
+  return 0;
+}
+
+static bool overlay_is_claimed(struct device *device, uint32_t plane_id)
+{
+  for (int i = 0; i < device->num_outputs; i++) {
+    if (plane_allocator_owns(&device->outputs[i]->planes, plane_id)) {
+      return true;
+    }
+  }
+
+  for (int i = 0; i < device->num_removed_outputs; i++) {
+    if (plane_allocator_owns(&device->removed_outputs[i]->planes, plane_id)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int compare_overlays(const void *a, const void *b)
+{
+  const struct overlay_plane *lhs = a;
+  const struct overlay_plane *rhs = b;
+
+  uint64_t lhs_zpos = lhs->zpos_mutable ? lhs->zpos_max : lhs->zpos;
+  uint64_t rhs_zpos = rhs->zpos_mutable ? rhs->zpos_max : rhs->zpos;
+
+  if (lhs_zpos == rhs_zpos) {
+    return 0;
+  }
+
+  return lhs_zpos > rhs_zpos ? -1 : 1;
+}
+
+static bool overlay_init(struct plane_allocator *allocator, struct overlay_plane *overlay,
+  uint32_t plane_id, int plane_index)
+{
+  struct device *device = allocator->output->device;
+
+  overlay->plane_id = plane_id;
+  overlay->props = drm_plane_props(device, plane_id);
+
+  if (!overlay->props || !drm_plane_props_usable(overlay->props)) {
+    return false;
+  }
+
+  if (overlay->props->ids[PLANE_PROP_ZPOS]) {
+    overlay->zpos = overlay->props->values[PLANE_PROP_ZPOS];
+    overlay->zpos_min = overlay->props->zpos_min;
+    overlay->zpos_max = overlay->props->zpos_max;
+    overlay->zpos_mutable = overlay->props->zpos_mutable;
+  } else {
+    // without zpos planes stack in the order the kernel lists them
+    overlay->zpos = allocator->primary_zpos + 1 + plane_index;
+    overlay->zpos_min = overlay->zpos;
+    overlay->zpos_max = overlay->zpos;
+  }
+
+  uint64_t highest = overlay->zpos_mutable ? overlay->zpos_max : overlay->zpos;
+  if (highest <= allocator->primary_zpos) {
+    // stuck underneath the primary plane, nothing drawn there would show
+    return false;
+  }
+
+  overlay->num_formats = drm_get_plane_formats(device, plane_id, &overlay->formats);
+
+  return overlay->num_formats > 0;
+}
+
+bool plane_allocator_init(struct plane_allocator *allocator, struct output *output)
+{
+  memset(allocator, 0, sizeof(*allocator));
+  allocator->output = output;
+
+  struct device *device = output->device;
+
+  uint32_t possible_crtcs = crtc_mask(device, output->crtc_id);
+  if (!possible_crtcs) {
+    printf("CRTC %d is not part of the device resources\n", output->crtc_id);
+    return false;
+  }
+
+  allocator->primary_zpos = output->primary_plane_props->values[PLANE_PROP_ZPOS];
+
+  for (int p = 0; p < device->num_planes; p++) {
+    if (allocator->num_overlays == PLANE_ALLOCATOR_MAX_OVERLAYS) {
+      break;
+    }
+
+    drmModePlanePtr plane = device->planes[p];
+
+    if (!(plane->possible_crtcs & possible_crtcs)) {
+      continue;
+    }
+
+    if (drm_get_plane_type(device, plane->plane_id) != DRM_PLANE_TYPE_OVERLAY) {
+      continue;
+    }
+
+    if (overlay_is_claimed(device, plane->plane_id)) {
+      continue;
+    }
+
+    struct overlay_plane *overlay = &allocator->overlays[allocator->num_overlays];
+    if (!overlay_init(allocator, overlay, plane->plane_id, p)) {
+      free(overlay->formats);
+      memset(overlay, 0, sizeof(*overlay));
+      continue;
+    }
+
+    allocator->num_overlays++;
+  }
+
+  qsort(allocator->overlays, allocator->num_overlays, sizeof(allocator->overlays[0]),
+    compare_overlays);
+
+  printf("Output %d has %d overlay planes\n", output->connector_id, allocator->num_overlays);
+
+  return true;
+}
+
+void plane_allocator_finish(struct plane_allocator *allocator)
+{
+  for (int i = 0; i < allocator->num_overlays; i++) {
+    free(allocator->overlays[i].formats);
+  }
+
+  memset(allocator, 0, sizeof(*allocator));
+}
+
+bool plane_allocator_owns(struct plane_allocator *allocator, uint32_t plane_id)
+{
+  for (int i = 0; i < allocator->num_overlays; i++) {
+    if (allocator->overlays[i].plane_id == plane_id) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool overlay_supports(struct overlay_plane *overlay, struct buffer *buffer)
+{
+  for (int i = 0; i < overlay->num_formats; i++) {
+    if (overlay->formats[i].format == buffer->dmabuf.format &&
+      overlay->formats[i].modifier == buffer->dmabuf.modifier)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// planes can't clip, so only layers entirely on screen are candidates. Drivers
+// don't advertise their scaling limits, the TEST_ONLY commit catches those.
+static bool layer_fits_output(struct output *output, struct layer *layer)
+{
+  struct buffer *buffer = layer->buffer;
+
+  // client buffers KMS couldn't wrap in a framebuffer can only be composited
+  if (!buffer || buffer->fb_id == 0 || layer->width == 0 || layer->height == 0 ||
+    layer->src_w == 0 || layer->src_h == 0)
+  {
+    return false;
+  }
+
+  if (layer->src_x + layer->src_w > buffer->dmabuf.width ||
+    layer->src_y + layer->src_h > buffer->dmabuf.height)
+  {
+    return false;
+  }
+
+  return layer->x >= 0 && layer->y >= 0 &&
+    layer->x + layer->width <= output->mode_info.hdisplay &&
+    layer->y + layer->height <= output->mode_info.vdisplay;
+}
+
+// picks a zpos for the overlay below the one assigned above it, if it can go there
+static bool overlay_zpos(struct plane_allocator *allocator, struct overlay_plane *overlay,
+  uint64_t ceiling, uint64_t *zpos)
+{
+  if (ceiling == 0) {
+    return false;
+  }
+
+  uint64_t z = overlay->zpos;
+  if (overlay->zpos_mutable) {
+    z = overlay->zpos_max < ceiling - 1 ? overlay->zpos_max : ceiling - 1;
+    if (z < overlay->zpos_min) {
+      return false;
+    }
+  }
+
+  if (z >= ceiling || z <= allocator->primary_zpos) {
+    return false;
+  }
+
+  *zpos = z;
+  return true;
+}
+
+// adds the overlay showing layer at zpos to the configuration key
+static uint64_t overlay_key(struct output *output, uint64_t key,
+  struct overlay_plane *overlay, struct layer *layer, uint64_t zpos)
+{
+  struct plane_cache_plane plane;
+  plane_cache_plane_init(&plane, overlay->plane_id, output->crtc_id, layer->buffer);
+
+  plane.src_x = layer->src_x;
+  plane.src_y = layer->src_y;
+  plane.src_w = layer->src_w;
+  plane.src_h = layer->src_h;
+  plane.crtc_x = layer->x;
+  plane.crtc_y = layer->y;
+  plane.crtc_w = layer->width;
+  plane.crtc_h = layer->height;
+  plane.zpos = zpos;
+
+  return plane_cache_key(key, &plane);
+}
+
+// TEST_ONLY commits can take milliseconds, a configuration is only sent to
+// the driver the first time it comes up
+static bool test_commit(struct plane_allocator *allocator, drmModeAtomicReqPtr req,
+  uint64_t key)
+{
+  bool valid;
+  if (plane_cache_lookup(&allocator->cache, key, &valid)) {
+    return valid;
+  }
+
+  int kms_fd = allocator->output->device->kms_fd;
+  valid = drmModeAtomicCommit(kms_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL) == 0;
+
+  plane_cache_insert(&allocator->cache, key, valid);
+
+  return valid;
+}
+
+bool plane_allocator_test_primary(struct plane_allocator *allocator, drmModeAtomicReqPtr req)
+{
+  return test_commit(allocator, req, allocator->primary_key);
+}
+
+void plane_allocator_invalidate(struct plane_allocator *allocator)
+{
+  plane_cache_clear(&allocator->cache);
+}
+
+static void overlay_add_layer(struct output *output, drmModeAtomicReqPtr req,
+  struct overlay_plane *overlay, struct layer *layer, uint64_t zpos)
+{
+  const uint32_t *ids = overlay->props->ids;
+  uint32_t plane_id = overlay->plane_id;
+
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_FB_ID], layer->buffer->fb_id);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_ID], output->crtc_id);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_SRC_X], (uint64_t)layer->src_x << 16);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_SRC_Y], (uint64_t)layer->src_y << 16);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_SRC_W], (uint64_t)layer->src_w << 16);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_SRC_H], (uint64_t)layer->src_h << 16);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_X], layer->x);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_Y], layer->y);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_W], layer->width);
+  drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_CRTC_H], layer->height);
+
+  if (overlay->zpos_mutable) {
+    drmModeAtomicAddProperty(req, plane_id, ids[PLANE_PROP_ZPOS], zpos);
+  }
+}
+
+int plane_allocator_assign(struct plane_allocator *allocator, drmModeAtomicReqPtr req,
+  struct scene *scene, int bottom)
+{
+  struct output *output = allocator->output;
+
+  // switch off everything shown last frame first, libdrm keeps the last value
+  // added for a property so overlays assigned below override this
+  plane_allocator_clear(allocator, req);
+
+  for (int i = bottom; i < scene->num_layers; i++) {
+    scene->layers[i].plane_id = 0;
+  }
+
+  int remaining = scene->num_layers - bottom;
+  int next_overlay = 0;
+  uint64_t ceiling = UINT64_MAX;
+
+  // overlays left off don't show up in the key, the request switches them off
+  uint64_t key = allocator->primary_key;
+
+  // the GPU composites into the primary plane, which is below every overlay,
+  // so once a layer misses out everything underneath it has to be composited
+  for (int i = scene->num_layers - 1; i >= bottom; i--) {
+    struct layer *layer = &scene->layers[i];
+
+    if (!layer_fits_output(output, layer)) {
+      break;
+    }
+
+    bool assigned = false;
+
+    for (int o = next_overlay; o < allocator->num_overlays && !assigned; o++) {
+      struct overlay_plane *overlay = &allocator->overlays[o];
+
+      uint64_t zpos;
+      if (!overlay_zpos(allocator, overlay, ceiling, &zpos)) {
+        continue;
+      }
+
+      if (!overlay_supports(overlay, layer->buffer)) {
+        continue;
+      }
+
+      int cursor = drmModeAtomicGetCursor(req);
+
+      overlay_add_layer(output, req, overlay, layer, zpos);
+
+      uint64_t candidate_key = overlay_key(output, key, overlay, layer, zpos);
+      if (!test_commit(allocator, req, candidate_key)) {
+        drmModeAtomicSetCursor(req, cursor);
+        continue;
+      }
+
+      key = candidate_key;
+      overlay->pending = true;
+      layer->plane_id = overlay->plane_id;
+      ceiling = zpos;
+      next_overlay = o + 1;
+      assigned = true;
+    }
+
+    if (!assigned) {
+      break;
+    }
+
+    remaining--;
+  }
+
+  return remaining;
+}
+
+void plane_allocator_clear(struct plane_allocator *allocator, drmModeAtomicReqPtr req)
+{
+  for (int o = 0; o < allocator->num_overlays; o++) {
+    struct overlay_plane *overlay = &allocator->overlays[o];
+    overlay->pending = false;
+
+    if (overlay->enabled) {
+      drmModeAtomicAddProperty(req, overlay->plane_id, overlay->props->ids[PLANE_PROP_FB_ID], 0);
+      drmModeAtomicAddProperty(req, overlay->plane_id, overlay->props->ids[PLANE_PROP_CRTC_ID], 0);
+    }
+  }
+}
+
+void plane_allocator_commit(struct plane_allocator *allocator)
+{
+  for (int o = 0; o < allocator->num_overlays; o++) {
+    allocator->overlays[o].enabled = allocator->overlays[o].pending;
+  }
+}
@@ -0,0 +1,69 @@
+#include "plane_cache.h"
+
+#include <string.h>
+
+#include "buffer.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+void plane_cache_clear(struct plane_cache *cache)
+{
+  memset(cache->entries, 0, sizeof(cache->entries));
+}
+
+void plane_cache_plane_init(struct plane_cache_plane *plane, uint32_t plane_id,
+  uint32_t crtc_id, struct buffer *buffer)
+{
+  // padding is hashed along with the fields
+  memset(plane, 0, sizeof(*plane));
+
+  plane->plane_id = plane_id;
+  plane->crtc_id = crtc_id;
+  plane->format = buffer->dmabuf.format;
+  plane->stride = buffer->dmabuf.strides[0];
+  plane->modifier = buffer->dmabuf.modifier;
+  plane->fb_width = buffer->dmabuf.width;
+  plane->fb_height = buffer->dmabuf.height;
+}
+
+uint64_t plane_cache_key(uint64_t key, const struct plane_cache_plane *plane)
+{
+  const uint8_t *bytes = (const uint8_t *)plane;
+
+  for (size_t i = 0; i < sizeof(*plane); i++) {
+    key ^= bytes[i];
+    key *= FNV_PRIME;
+  }
+
+  return key;
+}
+
+static struct plane_cache_entry *entry(struct plane_cache *cache, uint64_t key)
+{
+  return &cache->entries[(key ^ (key >> 32)) & (PLANE_CACHE_SIZE - 1)];
+}
+
+bool plane_cache_lookup(struct plane_cache *cache, uint64_t key, bool *valid)
+{
+  // 0 marks empty slots
+  key = key ? key : 1;
+
+  struct plane_cache_entry *e = entry(cache, key);
+  if (e->key != key) {
+    cache->stats.misses++;
+    return false;
+  }
+
+  cache->stats.hits++;
+  *valid = e->valid;
+  return true;
+}
+
+void plane_cache_insert(struct plane_cache *cache, uint64_t key, bool valid)
+{
+  key = key ? key : 1;
+
+  struct plane_cache_entry *e = entry(cache, key);
+  e->key = key;
+  e->valid = valid;
+}
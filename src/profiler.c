@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+
+#include "profiler.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "clock.h"
+
+struct profiler_stage {
+  const char *name;
+  bool worker;
+  int64_t start_nsec;
+  int64_t end_nsec;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_t main_thread;
+  int64_t start_nsec;
+
+  struct profiler_stage stages[PROFILER_MAX_STAGES];
+  int num_stages;
+} profiler = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void profiler_init(void)
+{
+  pthread_mutex_lock(&profiler.lock);
+  profiler.main_thread = pthread_self();
+  profiler.start_nsec = clock_now_nsec();
+  profiler.num_stages = 0;
+  pthread_mutex_unlock(&profiler.lock);
+}
+
+int profiler_begin(const char *name)
+{
+  int64_t now = clock_now_nsec();
+  int ret = -1;
+
+  pthread_mutex_lock(&profiler.lock);
+
+  if (profiler.num_stages < PROFILER_MAX_STAGES) {
+    ret = profiler.num_stages++;
+
+    struct profiler_stage *stage = &profiler.stages[ret];
+    stage->name = name;
+    stage->worker = !pthread_equal(pthread_self(), profiler.main_thread);
+    stage->start_nsec = now;
+    stage->end_nsec = 0;
+  }
+
+  pthread_mutex_unlock(&profiler.lock);
+
+  return ret;
+}
+
+void profiler_end(int stage)
+{
+  int64_t now = clock_now_nsec();
+
+  if (stage < 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&profiler.lock);
+  profiler.stages[stage].end_nsec = now;
+  pthread_mutex_unlock(&profiler.lock);
+}
+
+void profiler_mark(const char *name)
+{
+  profiler_end(profiler_begin(name));
+}
+
+static double to_msec(int64_t nsec)
+{
+  return (double)nsec / NSEC_PER_MSEC;
+}
+
+void profiler_report(void)
+{
+  pthread_mutex_lock(&profiler.lock);
+
+  printf("Startup profile, milliseconds since start:\n");
+
+  for (int i = 0; i < profiler.num_stages; i++) {
+    struct profiler_stage *stage = &profiler.stages[i];
+
+    double start = to_msec(stage->start_nsec - profiler.start_nsec);
+
+    if (stage->end_nsec == 0) {
+      printf("  %-6s %-24s %9.2f  (unfinished)\n",
+        stage->worker ? "worker" : "main", stage->name, start);
+      continue;
+    }
+
+    double end = to_msec(stage->end_nsec - profiler.start_nsec);
+
+    printf("  %-6s %-24s %9.2f .. %9.2f  %8.2f\n",
+      stage->worker ? "worker" : "main", stage->name, start, end, end - start);
+  }
+
+  pthread_mutex_unlock(&profiler.lock);
+}
@@ -0,0 +1,104 @@
+#include "quads.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+void quads_init(struct quad_list *list)
+{
+  memset(list, 0, sizeof(*list));
+  list->sorted = true;
+}
+
+void quads_finish(struct quad_list *list)
+{
+  free(list->quads);
+  free(list->batches);
+  memset(list, 0, sizeof(*list));
+}
+
+void quads_clear(struct quad_list *list)
+{
+  list->num_quads = 0;
+  list->num_batches = 0;
+  list->next_seq = 0;
+  list->sorted = true;
+}
+
+struct quad_instance *quads_add(struct quad_list *list, VkPipeline pipeline, uint32_t layer)
+{
+  if (list->num_quads == list->max_quads) {
+    list->max_quads = list->max_quads ? list->max_quads * 2 : 64;
+    list->quads = realloc(list->quads, list->max_quads * sizeof(*list->quads));
+    assert(list->quads);
+  }
+
+  struct quad *quad = &list->quads[list->num_quads++];
+  memset(quad, 0, sizeof(*quad));
+
+  quad->pipeline = pipeline;
+  quad->seq = list->next_seq++;
+  quad->instance.layer = layer;
+
+  list->sorted = false;
+
+  return &quad->instance;
+}
+
+static int compare_quads(const void *a, const void *b)
+{
+  const struct quad *lhs = a;
+  const struct quad *rhs = b;
+
+  if (lhs->instance.layer != rhs->instance.layer) {
+    return lhs->instance.layer < rhs->instance.layer ? -1 : 1;
+  }
+
+  if (lhs->pipeline != rhs->pipeline) {
+    return (uintptr_t)lhs->pipeline < (uintptr_t)rhs->pipeline ? -1 : 1;
+  }
+
+  // qsort isn't stable
+  return lhs->seq < rhs->seq ? -1 : lhs->seq > rhs->seq;
+}
+
+void quads_sort(struct quad_list *list)
+{
+  if (list->sorted) {
+    return;
+  }
+
+  qsort(list->quads, list->num_quads, sizeof(*list->quads), compare_quads);
+
+  // every quad could end up in a batch of its own
+  list->batches = realloc(list->batches, list->max_quads * sizeof(*list->batches));
+  assert(list->batches);
+  list->num_batches = 0;
+
+  // layers only order quads of one pipeline against another, so neighbours
+  // on different layers still share a draw
+  for (int i = 0; i < list->num_quads; i++) {
+    struct quad *quad = &list->quads[i];
+    struct quad_batch *last = list->num_batches > 0 ?
+      &list->batches[list->num_batches - 1] : NULL;
+
+    if (last && last->pipeline == quad->pipeline) {
+      last->count++;
+      continue;
+    }
+
+    struct quad_batch *batch = &list->batches[list->num_batches++];
+    batch->pipeline = quad->pipeline;
+    batch->first = i;
+    batch->count = 1;
+  }
+
+  list->sorted = true;
+}
+
+void quads_write(const struct quad_list *list, struct quad_instance *dst)
+{
+  for (int i = 0; i < list->num_quads; i++) {
+    dst[i] = list->quads[i].instance;
+  }
+}
@@ -0,0 +1,683 @@
+#define _GNU_SOURCE
+
+#include "render.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vulkan/vulkan.h>
+
+#include "buffer.h"
+#include "clock.h"
+#include "damage.h"
+#include "device.h"
+#include "output.h"
+#include "quads.h"
+#include "scene.h"
+#include "swapchain.h"
+#include "vk_device.h"
+#include "vk_staging.h"
+
+static bool create_frame_resources(struct vk_device *vk_dev, struct buffer *buffer)
+{
+  VkResult res;
+
+  VkFenceCreateInfo fence_info = {0};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+  res = vkCreateFence(vk_dev->device, &fence_info, NULL, &buffer->fence);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateFence failed: %d\n", res);
+    goto error;
+  }
+
+  VkExportSemaphoreCreateInfo export_info = {0};
+  export_info.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+  export_info.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+  VkSemaphoreCreateInfo semaphore_info = {0};
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphore_info.pNext = &export_info;
+
+  res = vkCreateSemaphore(vk_dev->device, &semaphore_info, NULL, &buffer->render_semaphore);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateSemaphore failed: %d\n", res);
+    goto error;
+  }
+
+  semaphore_info.pNext = NULL;
+
+  res = vkCreateSemaphore(vk_dev->device, &semaphore_info, NULL, &buffer->release_semaphore);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateSemaphore failed: %d\n", res);
+    goto error;
+  }
+
+  VkCommandBufferAllocateInfo cbi = {0};
+  cbi.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cbi.commandPool = vk_dev->command_pool;
+  cbi.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cbi.commandBufferCount = 1;
+
+  res = vkAllocateCommandBuffers(vk_dev->device, &cbi, &buffer->command_buffer);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkAllocateCommandBuffers failed: %d\n", res);
+    goto error;
+  }
+
+  if (vk_dev->compute_composition) {
+    res = vkCreateSemaphore(vk_dev->device, &semaphore_info, NULL, &buffer->rendered_semaphore);
+    if (res != VK_SUCCESS) {
+      fprintf(stderr, "vkCreateSemaphore failed: %d\n", res);
+      goto error_command_buffer;
+    }
+
+    cbi.commandPool = vk_dev->compute_command_pool;
+
+    res = vkAllocateCommandBuffers(vk_dev->device, &cbi, &buffer->compose_command_buffer);
+    if (res != VK_SUCCESS) {
+      fprintf(stderr, "vkAllocateCommandBuffers failed: %d\n", res);
+      goto error_command_buffer;
+    }
+  }
+
+  return true;
+
+error_command_buffer:
+  vkDestroySemaphore(vk_dev->device, buffer->rendered_semaphore, NULL);
+  buffer->rendered_semaphore = VK_NULL_HANDLE;
+  vkFreeCommandBuffers(vk_dev->device, vk_dev->command_pool, 1, &buffer->command_buffer);
+  buffer->command_buffer = VK_NULL_HANDLE;
+
+error:
+  vkDestroySemaphore(vk_dev->device, buffer->release_semaphore, NULL);
+  vkDestroySemaphore(vk_dev->device, buffer->render_semaphore, NULL);
+  vkDestroyFence(vk_dev->device, buffer->fence, NULL);
+  buffer->release_semaphore = VK_NULL_HANDLE;
+  buffer->render_semaphore = VK_NULL_HANDLE;
+  buffer->fence = VK_NULL_HANDLE;
+  return false;
+}
+
+static bool import_release_fence(struct vk_device *vk_dev, struct buffer *buffer)
+{
+  VkImportSemaphoreFdInfoKHR import_info = {0};
+  import_info.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR;
+  import_info.semaphore = buffer->release_semaphore;
+  import_info.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT;
+  import_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+  import_info.fd = buffer->release_fence_fd;
+
+  VkResult res = vk_dev->import_semaphore_fd(vk_dev->device, &import_info);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkImportSemaphoreFdKHR failed: %d\n", res);
+    return false;
+  }
+
+  // the semaphore owns the sync_file now
+  buffer->release_fence_fd = -1;
+
+  return true;
+}
+
+// clips the layer to a damaged rectangle, shrinking the source region to match
+static bool clip_layer(struct layer *layer, const struct damage_rect *clip, VkImageBlit *blit)
+{
+  int64_t x0 = layer->x;
+  int64_t y0 = layer->y;
+  int64_t x1 = x0 + layer->width;
+  int64_t y1 = y0 + layer->height;
+
+  int64_t cx0 = x0 < clip->x1 ? clip->x1 : x0;
+  int64_t cy0 = y0 < clip->y1 ? clip->y1 : y0;
+  int64_t cx1 = x1 > clip->x2 ? clip->x2 : x1;
+  int64_t cy1 = y1 > clip->y2 ? clip->y2 : y1;
+
+  if (!layer->buffer || layer->width == 0 || layer->height == 0 || cx0 >= cx1 || cy0 >= cy1) {
+    return false;
+  }
+
+  double scale_x = (double)layer->src_w / layer->width;
+  double scale_y = (double)layer->src_h / layer->height;
+
+  memset(blit, 0, sizeof(*blit));
+  blit->srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  blit->srcSubresource.layerCount = 1;
+  blit->srcOffsets[0].x = layer->src_x + (int32_t)((cx0 - x0) * scale_x);
+  blit->srcOffsets[0].y = layer->src_y + (int32_t)((cy0 - y0) * scale_y);
+  blit->srcOffsets[1].x = layer->src_x + (int32_t)((cx1 - x0) * scale_x);
+  blit->srcOffsets[1].y = layer->src_y + (int32_t)((cy1 - y0) * scale_y);
+  blit->srcOffsets[1].z = 1;
+
+  blit->dstSubresource = blit->srcSubresource;
+  blit->dstOffsets[0].x = cx0;
+  blit->dstOffsets[0].y = cy0;
+  blit->dstOffsets[1].x = cx1;
+  blit->dstOffsets[1].y = cy1;
+  blit->dstOffsets[1].z = 1;
+
+  return true;
+}
+
+// layers without an overlay plane are copied on top of the rendered frame
+static void record_composition(struct output *output, struct buffer *buffer,
+  const struct damage *damage)
+{
+  VkCommandBuffer cb = buffer->command_buffer;
+  struct scene *scene = &output->scene;
+
+  bool barrier_done = false;
+
+  for (int i = 0; i < scene->num_layers; i++) {
+    struct layer *layer = &scene->layers[i];
+    if (layer->plane_id != 0 || !layer->buffer || !buffer_import_image(layer->buffer)) {
+      continue;
+    }
+
+    for (int r = 0; r < damage->num_rects; r++) {
+      VkImageBlit blit;
+      if (!clip_layer(layer, &damage->rects[r], &blit)) {
+        continue;
+      }
+
+      if (!barrier_done) {
+        // the render pass leaves the frame in GENERAL, and dmabuf contents
+        // written by their producer are treated as GENERAL too
+        VkMemoryBarrier barrier = {0};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+
+        vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+          VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+
+        barrier_done = true;
+      }
+
+      vkCmdBlitImage(cb, layer->buffer->image, VK_IMAGE_LAYOUT_GENERAL,
+        buffer->image, VK_IMAGE_LAYOUT_GENERAL, 1, &blit, VK_FILTER_LINEAR);
+    }
+  }
+}
+
+static void push_layer_images(struct vk_device *vk_dev, VkCommandBuffer cb,
+  struct buffer *src, struct buffer *dst)
+{
+  VkDescriptorImageInfo src_info = {0};
+  src_info.sampler = vk_dev->compose_sampler;
+  src_info.imageView = src->storage_view;
+  src_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+  VkDescriptorImageInfo dst_info = {0};
+  dst_info.imageView = dst->storage_view;
+  dst_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+  VkWriteDescriptorSet writes[2] = {0};
+  writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[0].dstBinding = 0;
+  writes[0].descriptorCount = 1;
+  writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  writes[0].pImageInfo = &src_info;
+  writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[1].dstBinding = 1;
+  writes[1].descriptorCount = 1;
+  writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  writes[1].pImageInfo = &dst_info;
+
+  vk_dev->push_descriptor_set(cb, VK_PIPELINE_BIND_POINT_COMPUTE, vk_dev->compose_layout,
+    0, 2, writes);
+}
+
+// the compute queue's version of record_composition, run once the render
+// pass finished on the graphics queue
+static void record_compute_composition(struct vk_device *vk_dev, struct output *output,
+  struct buffer *buffer, const struct damage *damage)
+{
+  VkCommandBuffer cb = buffer->compose_command_buffer;
+  struct scene *scene = &output->scene;
+
+  VkCommandBufferBeginInfo begin_info = {0};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+  vkBeginCommandBuffer(cb, &begin_info);
+
+  vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, vk_dev->compose_pipeline);
+
+  bool first = true;
+
+  for (int i = 0; i < scene->num_layers; i++) {
+    struct layer *layer = &scene->layers[i];
+    if (layer->plane_id != 0 || !layer->buffer || !buffer_import_image(layer->buffer)) {
+      continue;
+    }
+
+    bool pushed = false;
+
+    for (int r = 0; r < damage->num_rects; r++) {
+      VkImageBlit blit;
+      if (!clip_layer(layer, &damage->rects[r], &blit)) {
+        continue;
+      }
+
+      if (!pushed) {
+        // layers overlap, each one lands on top of the ones below it
+        if (!first) {
+          VkMemoryBarrier barrier = {0};
+          barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+          barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+          barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+
+          vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+        }
+
+        push_layer_images(vk_dev, cb, layer->buffer, buffer);
+        pushed = true;
+        first = false;
+      }
+
+      struct vk_compose_blit constants = {0};
+      constants.dst_offset[0] = blit.dstOffsets[0].x;
+      constants.dst_offset[1] = blit.dstOffsets[0].y;
+      constants.dst_extent[0] = blit.dstOffsets[1].x - blit.dstOffsets[0].x;
+      constants.dst_extent[1] = blit.dstOffsets[1].y - blit.dstOffsets[0].y;
+      constants.src_offset[0] = blit.srcOffsets[0].x;
+      constants.src_offset[1] = blit.srcOffsets[0].y;
+      constants.src_extent[0] = blit.srcOffsets[1].x - blit.srcOffsets[0].x;
+      constants.src_extent[1] = blit.srcOffsets[1].y - blit.srcOffsets[0].y;
+
+      vkCmdPushConstants(cb, vk_dev->compose_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+        sizeof(constants), &constants);
+
+      // 16x16 workgroups, see compose.comp
+      vkCmdDispatch(cb, (constants.dst_extent[0] + 15) / 16,
+        (constants.dst_extent[1] + 15) / 16, 1);
+    }
+  }
+
+  vkEndCommandBuffer(cb);
+}
+
+// the render pass loads the previous contents from GENERAL, which a buffer
+// never rendered into isn't in yet
+static void record_initial_layout(struct buffer *buffer)
+{
+  VkImageMemoryBarrier barrier = {0};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = buffer->image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.layerCount = 1;
+
+  vkCmdPipelineBarrier(buffer->command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+static VkRect2D damage_to_vk(const struct damage_rect *rect)
+{
+  VkRect2D ret = {0};
+  ret.offset.x = rect->x1;
+  ret.offset.y = rect->y1;
+  ret.extent.width = rect->x2 - rect->x1;
+  ret.extent.height = rect->y2 - rect->y1;
+  return ret;
+}
+
+// layers the GPU copies in, as a mask of their indices
+static uint32_t composited_layers(struct scene *scene)
+{
+  uint32_t ret = 0;
+
+  for (int i = 0; i < scene->num_layers; i++) {
+    if (scene->layers[i].plane_id == 0 && scene->layers[i].buffer) {
+      ret |= 1u << i;
+    }
+  }
+
+  return ret;
+}
+
+// writes the frame's uniforms into the buffer's slice of the uniform ring.
+// The arena was reset when the buffer was acquired, so an unchanged frame
+// lands on the same offset and its recording can still be reused.
+static bool write_uniforms(struct output *output, struct buffer *buffer, uint32_t *offset)
+{
+  struct swapchain *swapchain = output->swapchain;
+  struct vk_arena *arena = swapchain_arena(swapchain, buffer);
+
+  VkDeviceSize start;
+  void *mapped;
+  if (!arena || !vk_arena_alloc(arena, sizeof(struct vk_draw_uniforms),
+    swapchain->uniform_alignment, &start, &mapped))
+  {
+    return false;
+  }
+
+  struct vk_draw_uniforms uniforms = {0};
+  uniforms.viewport[0] = buffer->dmabuf.width;
+  uniforms.viewport[1] = buffer->dmabuf.height;
+
+  memcpy(mapped, &uniforms, sizeof(uniforms));
+  *offset = start;
+
+  return true;
+}
+
+// uploads the sorted quads into the buffer's slice of the instance buffer.
+// The frame that last read the slice is done, its fence was waited on, and
+// the flush before the submit lands the copy ahead of this one.
+static bool upload_quads(struct vk_device *vk_dev, struct output *output,
+  struct buffer *buffer, uint32_t *first_instance)
+{
+  struct swapchain *swapchain = output->swapchain;
+  struct quad_list *quads = &output->scene.quads;
+
+  int index = swapchain_index(swapchain, buffer);
+  VkDeviceSize size = quads->num_quads * sizeof(struct quad_instance);
+  if (index < 0 || size > SWAPCHAIN_INSTANCES_SIZE) {
+    return false;
+  }
+
+  VkDeviceSize start = (VkDeviceSize)index * SWAPCHAIN_INSTANCES_SIZE;
+  struct quad_instance *mapped = vk_staging_map_buffer(vk_dev->staging,
+    swapchain->instance_buffer, start, size);
+  if (!mapped) {
+    return false;
+  }
+
+  quads_write(quads, mapped);
+  *first_instance = start / sizeof(struct quad_instance);
+
+  return true;
+}
+
+// copies the scene's quads, sorted into batches, after the uniforms. Draws
+// reach them through the first instance, so the offset only needs to be a
+// whole number of instances into the buffer.
+static bool write_quads(struct vk_device *vk_dev, struct output *output,
+  struct buffer *buffer, uint32_t *first_instance)
+{
+  struct swapchain *swapchain = output->swapchain;
+  struct quad_list *quads = &output->scene.quads;
+
+  quads_sort(quads);
+
+  *first_instance = 0;
+  if (quads->num_quads == 0) {
+    return true;
+  }
+
+  if (swapchain->instance_buffer) {
+    return upload_quads(vk_dev, output, buffer, first_instance);
+  }
+
+  VkDeviceSize start;
+  void *mapped;
+  if (!vk_arena_alloc(swapchain_arena(swapchain, buffer),
+    quads->num_quads * sizeof(struct quad_instance), sizeof(struct quad_instance),
+    &start, &mapped))
+  {
+    return false;
+  }
+
+  quads_write(quads, mapped);
+  *first_instance = start / sizeof(struct quad_instance);
+
+  return true;
+}
+
+// the buffer's command buffer depends on nothing but these, besides the
+// buffer itself, which is recreated along with the swapchain when the mode
+// changes
+static bool recording_matches(struct output *output, struct buffer *buffer,
+  const struct damage *damage, uint32_t uniforms, uint32_t first_instance)
+{
+  return buffer->recorded &&
+    buffer->recorded_initial == (buffer->age == 0) &&
+    buffer->recorded_uniforms == uniforms &&
+    buffer->recorded_instances == first_instance &&
+    buffer->recorded_scene == output->scene.generation &&
+    buffer->recorded_layers == composited_layers(&output->scene) &&
+    buffer->recorded_damage.num_rects == damage->num_rects &&
+    memcmp(buffer->recorded_damage.rects, damage->rects,
+      damage->num_rects * sizeof(damage->rects[0])) == 0;
+}
+
+static void record_frame(struct vk_device *vk_dev, struct output *output, struct buffer *buffer,
+  const struct damage *damage, uint32_t uniforms, uint32_t first_instance)
+{
+  VkCommandBuffer cb = buffer->command_buffer;
+
+  uint32_t width = buffer->dmabuf.width;
+  uint32_t height = buffer->dmabuf.height;
+
+  VkCommandBufferBeginInfo begin_info = {0};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  // kept for resubmission, the fence wait keeps it from being pending twice
+  begin_info.flags = 0;
+
+  vkBeginCommandBuffer(cb, &begin_info);
+
+  if (buffer->age == 0) {
+    record_initial_layout(buffer);
+  }
+
+  struct damage_rect extents = damage_extents(damage);
+
+  VkRenderPassBeginInfo rp_info = {0};
+  rp_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  rp_info.renderPass = vk_dev->render_pass;
+  rp_info.framebuffer = buffer->framebuffer;
+  rp_info.renderArea = damage_to_vk(&extents);
+
+  vkCmdBeginRenderPass(cb, &rp_info, VK_SUBPASS_CONTENTS_INLINE);
+
+  VkViewport viewport = {0};
+  viewport.width = width;
+  viewport.height = height;
+  viewport.maxDepth = 1.f;
+
+  vkCmdSetViewport(cb, 0, 1, &viewport);
+
+  VkClearAttachment clear = {0};
+  clear.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  clear.colorAttachment = 0;
+  clear.clearValue.color.float32[3] = 1.f;
+
+  VkClearRect clear_rects[DAMAGE_MAX_RECTS];
+  for (int r = 0; r < damage->num_rects; r++) {
+    clear_rects[r].rect = damage_to_vk(&damage->rects[r]);
+    clear_rects[r].baseArrayLayer = 0;
+    clear_rects[r].layerCount = 1;
+  }
+
+  // everything outside the damage is kept from the buffer's previous frame
+  if (damage->num_rects > 0) {
+    vkCmdClearAttachments(cb, 1, &clear, damage->num_rects, clear_rects);
+  }
+
+  VkPipeline bound = vk_dev->pipeline;
+  vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, bound);
+
+  // every pipeline shares the layout, so the set stays bound across them
+  vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_dev->pipeline_layout, 0, 1,
+    &output->swapchain->descriptor_set, 1, &uniforms);
+
+  struct quad_list *quads = &output->scene.quads;
+
+  for (int r = 0; r < damage->num_rects; r++) {
+    vkCmdSetScissor(cb, 0, 1, &clear_rects[r].rect);
+
+    for (int b = 0; b < quads->num_batches; b++) {
+      struct quad_batch *batch = &quads->batches[b];
+      VkPipeline pipeline = batch->pipeline ? batch->pipeline : vk_dev->pipeline;
+
+      if (pipeline != bound) {
+        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        bound = pipeline;
+      }
+
+      vkCmdDraw(cb, 4, batch->count, 0, first_instance + batch->first);
+    }
+  }
+
+  vkCmdEndRenderPass(cb);
+
+  if (vk_dev->compute_composition) {
+    record_compute_composition(vk_dev, output, buffer, damage);
+  } else {
+    record_composition(output, buffer, damage);
+  }
+
+  buffer->recorded = vkEndCommandBuffer(cb) == VK_SUCCESS;
+  buffer->recorded_initial = buffer->age == 0;
+  buffer->recorded_scene = output->scene.generation;
+  buffer->recorded_layers = composited_layers(&output->scene);
+  buffer->recorded_uniforms = uniforms;
+  buffer->recorded_instances = first_instance;
+  buffer->recorded_damage = *damage;
+}
+
+// signals the buffer's fence once wait_semaphore has, when the submit meant
+// to signal it failed. Otherwise the buffer never counts as idle again and
+// destroying it waits forever.
+static void release_fence(VkQueue queue, VkSemaphore wait_semaphore, VkFence fence)
+{
+  VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+  VkSubmitInfo submit_info = {0};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  if (wait_semaphore != VK_NULL_HANDLE) {
+    submit_info.waitSemaphoreCount = 1;
+    submit_info.pWaitSemaphores = &wait_semaphore;
+    submit_info.pWaitDstStageMask = &wait_stage;
+  }
+
+  VkResult res = vkQueueSubmit(queue, 1, &submit_info, fence);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkQueueSubmit failed to release a fence: %d\n", res);
+  }
+}
+
+bool render_frame(struct output *output, struct buffer *buffer, const struct damage *damage,
+  int *render_fence_fd)
+{
+  VkResult res;
+
+  struct vk_device *vk_dev = output->device->vk_device;
+
+  if (!buffer->command_buffer && !create_frame_resources(vk_dev, buffer)) {
+    return false;
+  }
+
+  // swapchain_acquire only hands out idle buffers, so this never blocks. The
+  // fence is only reset right before the submit that signals it, a frame
+  // given up on before that leaves the buffer idle.
+  vkWaitForFences(vk_dev->device, 1, &buffer->fence, VK_TRUE, UINT64_MAX);
+
+  uint32_t uniforms;
+  uint32_t first_instance;
+  if (!write_uniforms(output, buffer, &uniforms) ||
+    !write_quads(vk_dev, output, buffer, &first_instance))
+  {
+    fprintf(stderr, "Out of space for the uniforms and quads of output %d\n",
+      output->connector_id);
+    return false;
+  }
+
+  // steady animations and unchanged scenes repeat the same commands
+  if (!recording_matches(output, buffer, damage, uniforms, first_instance)) {
+    record_frame(vk_dev, output, buffer, damage, uniforms, first_instance);
+  }
+
+  output->frame.record_nsec = clock_now_nsec();
+
+  // uploads made since the last frame land before it runs
+  if (vk_dev->staging) {
+    vk_staging_flush(vk_dev->staging);
+  }
+
+  VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+  // composition runs on the compute queue, overlapping the graphics work of
+  // the next frame, and the frame is done once it finishes
+  bool compose = vk_dev->compute_composition && composited_layers(&output->scene) != 0;
+
+  VkSubmitInfo submit_info = {0};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &buffer->command_buffer;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = compose ? &buffer->rendered_semaphore :
+    &buffer->render_semaphore;
+
+  // KMS may still be scanning out of this buffer, let the GPU wait for it
+  if (buffer->release_fence_fd >= 0 && import_release_fence(vk_dev, buffer)) {
+    submit_info.waitSemaphoreCount = 1;
+    submit_info.pWaitSemaphores = &buffer->release_semaphore;
+    submit_info.pWaitDstStageMask = &wait_stage;
+  }
+
+  if (!compose) {
+    vkResetFences(vk_dev->device, 1, &buffer->fence);
+  }
+
+  res = vkQueueSubmit(vk_dev->queue, 1, &submit_info, compose ? VK_NULL_HANDLE : buffer->fence);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkQueueSubmit failed: %d\n", res);
+    if (!compose) {
+      release_fence(vk_dev->queue, VK_NULL_HANDLE, buffer->fence);
+    }
+    return false;
+  }
+
+  if (compose) {
+    VkPipelineStageFlags compose_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+    VkSubmitInfo compose_info = {0};
+    compose_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    compose_info.waitSemaphoreCount = 1;
+    compose_info.pWaitSemaphores = &buffer->rendered_semaphore;
+    compose_info.pWaitDstStageMask = &compose_stage;
+    compose_info.commandBufferCount = 1;
+    compose_info.pCommandBuffers = &buffer->compose_command_buffer;
+    compose_info.signalSemaphoreCount = 1;
+    compose_info.pSignalSemaphores = &buffer->render_semaphore;
+
+    vkResetFences(vk_dev->device, 1, &buffer->fence);
+
+    res = vkQueueSubmit(vk_dev->compute_queue, 1, &compose_info, buffer->fence);
+    if (res != VK_SUCCESS) {
+      fprintf(stderr, "vkQueueSubmit failed on the compute queue: %d\n", res);
+      // the graphics work went out, its semaphore still has to be waited on
+      release_fence(vk_dev->compute_queue, buffer->rendered_semaphore, buffer->fence);
+      return false;
+    }
+  }
+
+  output->frame.submit_nsec = clock_now_nsec();
+
+  VkSemaphoreGetFdInfoKHR get_fd_info = {0};
+  get_fd_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+  get_fd_info.semaphore = buffer->render_semaphore;
+  get_fd_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+  // drivers hand out -1 when the semaphore has already signalled
+  *render_fence_fd = -1;
+  res = vk_dev->get_semaphore_fd(vk_dev->device, &get_fd_info, render_fence_fd);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkGetSemaphoreFdKHR failed: %d\n", res);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,66 @@
+#include "scene.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer.h"
+
+void scene_init(struct scene *scene)
+{
+  memset(scene, 0, sizeof(*scene));
+  quads_init(&scene->quads);
+}
+
+void scene_finish(struct scene *scene)
+{
+  quads_finish(&scene->quads);
+}
+
+struct layer *scene_add_layer(struct scene *scene, struct buffer *buffer, int32_t x, int32_t y)
+{
+  if (scene->num_layers == SCENE_MAX_LAYERS) {
+    fprintf(stderr, "Scene is limited to %d layers\n", SCENE_MAX_LAYERS);
+    return NULL;
+  }
+
+  struct layer *layer = &scene->layers[scene->num_layers++];
+  memset(layer, 0, sizeof(*layer));
+
+  layer->buffer = buffer;
+  layer->src_w = buffer->dmabuf.width;
+  layer->src_h = buffer->dmabuf.height;
+  layer->x = x;
+  layer->y = y;
+  layer->width = buffer->dmabuf.width;
+  layer->height = buffer->dmabuf.height;
+
+  scene_changed(scene);
+
+  return layer;
+}
+
+void scene_remove_layer(struct scene *scene, struct layer *layer)
+{
+  int index = layer - scene->layers;
+  if (index < 0 || index >= scene->num_layers) {
+    return;
+  }
+
+  memmove(&scene->layers[index], &scene->layers[index + 1],
+    (scene->num_layers - index - 1) * sizeof(*layer));
+  scene->num_layers--;
+
+  scene_changed(scene);
+}
+
+struct quad_instance *scene_add_quad(struct scene *scene, VkPipeline pipeline, uint32_t layer)
+{
+  scene_changed(scene);
+
+  return quads_add(&scene->quads, pipeline, layer);
+}
+
+void scene_changed(struct scene *scene)
+{
+  scene->generation++;
+}
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+
+#include "scheduler.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "clock.h"
+
+// slack for the commit ioctl and the driver's vblank evasion
+#define SCHEDULER_MARGIN_NSEC (1 * NSEC_PER_MSEC)
+
+bool scheduler_init(struct scheduler *scheduler, int64_t refresh_nsec)
+{
+  memset(scheduler, 0, sizeof(*scheduler));
+  scheduler->refresh_nsec = refresh_nsec;
+
+  scheduler->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (scheduler->timer_fd < 0) {
+    fprintf(stderr, "timerfd_create failed: %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+void scheduler_finish(struct scheduler *scheduler)
+{
+  if (scheduler->timer_fd >= 0) {
+    close(scheduler->timer_fd);
+    scheduler->timer_fd = -1;
+  }
+}
+
+void scheduler_set_vrr(struct scheduler *scheduler, bool vrr)
+{
+  scheduler->vrr = vrr;
+}
+
+int64_t scheduler_budget(struct scheduler *scheduler)
+{
+  // nothing measured yet, render as early as possible
+  if (scheduler->num_samples == 0) {
+    return scheduler->refresh_nsec;
+  }
+
+  int64_t budget = 0;
+  for (int i = 0; i < scheduler->num_samples; i++) {
+    if (scheduler->samples[i] > budget) {
+      budget = scheduler->samples[i];
+    }
+  }
+
+  budget += SCHEDULER_MARGIN_NSEC;
+
+  return budget < scheduler->refresh_nsec ? budget : scheduler->refresh_nsec;
+}
+
+void scheduler_add_sample(struct scheduler *scheduler, int64_t render_nsec)
+{
+  scheduler->samples[scheduler->next_sample] = render_nsec;
+  scheduler->next_sample = (scheduler->next_sample + 1) % SCHEDULER_WINDOW;
+
+  if (scheduler->num_samples < SCHEDULER_WINDOW) {
+    scheduler->num_samples++;
+  }
+}
+
+static void scheduler_arm(struct scheduler *scheduler, int64_t start_nsec)
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = start_nsec / NSEC_PER_SEC;
+  its.it_value.tv_nsec = start_nsec % NSEC_PER_SEC;
+
+  if (timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+    fprintf(stderr, "timerfd_settime failed: %s\n", strerror(errno));
+  }
+}
+
+static void scheduler_arm_next_vblank(struct scheduler *scheduler)
+{
+  int64_t now = clock_now_nsec();
+  int64_t target = scheduler->last_flip_nsec + scheduler->refresh_nsec;
+
+  // the event was delivered late, or the output sat idle, and the predicted
+  // vblank already passed. A variable refresh panel is still waiting for a
+  // frame, so it can go out as soon as it is rendered instead.
+  if (target <= now && scheduler->vrr) {
+    target = now + scheduler_budget(scheduler);
+  } else if (target <= now) {
+    target += ((now - target) / scheduler->refresh_nsec + 1) * scheduler->refresh_nsec;
+  }
+
+  int64_t start = target - scheduler_budget(scheduler);
+  if (start < now) {
+    start = now;
+  }
+
+  scheduler->target_vblank_nsec = target;
+
+  scheduler_arm(scheduler, start);
+}
+
+void scheduler_flip(struct scheduler *scheduler, int64_t flip_nsec)
+{
+  // the frame landed a vblank late, back off to rendering right after the
+  // flip until the miss ages out of the window. Late frames under variable
+  // refresh only stretch the refresh, they don't cost a whole one.
+  if (!scheduler->vrr && scheduler->target_vblank_nsec != 0 &&
+    flip_nsec > scheduler->target_vblank_nsec + scheduler->refresh_nsec / 2)
+  {
+    scheduler_add_sample(scheduler, scheduler->refresh_nsec);
+  }
+
+  scheduler->last_flip_nsec = flip_nsec;
+
+  scheduler_arm_next_vblank(scheduler);
+}
+
+void scheduler_wake(struct scheduler *scheduler)
+{
+  // never flipped, there is no vblank to line up with yet
+  if (scheduler->last_flip_nsec == 0) {
+    scheduler_arm(scheduler, clock_now_nsec());
+    return;
+  }
+
+  scheduler_arm_next_vblank(scheduler);
+}
+
+void scheduler_defer(struct scheduler *scheduler)
+{
+  scheduler_arm(scheduler, clock_now_nsec() + scheduler->refresh_nsec);
+}
+
+void scheduler_ack(struct scheduler *scheduler)
+{
+  uint64_t expirations;
+  ssize_t ret = read(scheduler->timer_fd, &expirations, sizeof(expirations));
+  (void)ret;
+}
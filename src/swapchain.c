@@ -0,0 +1,296 @@
+#include "swapchain.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <vulkan/vulkan.h>
+
+#include <drm_fourcc.h>
+
+#include "buffer.h"
+#include "device.h"
+#include "modifiers.h"
+#include "output.h"
+#include "vk_staging.h"
+
+// matches the B8G8R8A8 layout of the render pass attachment
+#define SCANOUT_FORMAT DRM_FORMAT_XRGB8888
+
+static bool create_uniforms(struct swapchain *swapchain, struct vk_device *vk_dev)
+{
+  if (!vk_memory_create_buffer(vk_dev->memory, BUFFER_QUEUE_DEPTH * SWAPCHAIN_ARENA_SIZE,
+    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+    VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    &swapchain->uniform_buffer, &swapchain->uniform_allocation))
+  {
+    return false;
+  }
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(vk_dev->physical_device, &props);
+  swapchain->uniform_alignment = props.limits.minUniformBufferOffsetAlignment;
+
+  for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
+    vk_arena_init_slice(&swapchain->arenas[i], swapchain->uniform_buffer,
+      &swapchain->uniform_allocation, i * SWAPCHAIN_ARENA_SIZE, SWAPCHAIN_ARENA_SIZE);
+  }
+
+  // only the vertex shader reads the instances, so they go where it reads
+  // fastest and the copy happens on the transfer queue
+  if (vk_dev->staging) {
+    uint32_t families[2];
+    uint32_t num_families = vk_staging_queue_families(vk_dev->staging, families);
+
+    if (!vk_memory_create_shared_buffer(vk_dev->memory,
+      BUFFER_QUEUE_DEPTH * SWAPCHAIN_INSTANCES_SIZE,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, families, num_families,
+      &swapchain->instance_buffer, &swapchain->instance_allocation))
+    {
+      return false;
+    }
+  }
+
+  VkDescriptorSetAllocateInfo dsi = {0};
+  dsi.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  dsi.descriptorPool = vk_dev->descriptor_pool;
+  dsi.descriptorSetCount = 1;
+  dsi.pSetLayouts = &vk_dev->descriptor_set_layout;
+
+  VkResult res = vkAllocateDescriptorSets(vk_dev->device, &dsi, &swapchain->descriptor_set);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkAllocateDescriptorSets failed: %d\n", res);
+    return false;
+  }
+
+  VkDescriptorBufferInfo buffer_infos[2] = {0};
+  buffer_infos[0].buffer = swapchain->uniform_buffer;
+  buffer_infos[0].range = sizeof(struct vk_draw_uniforms);
+  buffer_infos[1].buffer = swapchain->instance_buffer ?
+    swapchain->instance_buffer : swapchain->uniform_buffer;
+  buffer_infos[1].range = VK_WHOLE_SIZE;
+
+  VkWriteDescriptorSet writes[2] = {0};
+  writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[0].dstSet = swapchain->descriptor_set;
+  writes[0].dstBinding = 0;
+  writes[0].descriptorCount = 1;
+  writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  writes[0].pBufferInfo = &buffer_infos[0];
+  writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[1].dstSet = swapchain->descriptor_set;
+  writes[1].dstBinding = 1;
+  writes[1].descriptorCount = 1;
+  writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  writes[1].pBufferInfo = &buffer_infos[1];
+
+  vkUpdateDescriptorSets(vk_dev->device, 2, writes, 0, NULL);
+
+  return true;
+}
+
+struct swapchain *swapchain_create(struct output *output)
+{
+  struct swapchain *ret = calloc(1, sizeof(*ret));
+  assert(ret);
+
+  ret->output = output;
+
+  uint32_t width = output->mode_info.hdisplay;
+  uint32_t height = output->mode_info.vdisplay;
+
+  const uint64_t *modifiers = NULL;
+  int num_modifiers = modifiers_get(output->device, output->primary_plane_id,
+    SCANOUT_FORMAT, &modifiers);
+
+  // linear is the one layout both scanout and every vulkan driver agree on
+  const uint64_t linear = DRM_FORMAT_MOD_LINEAR;
+
+  for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
+    struct buffer *buffer = NULL;
+
+    if (num_modifiers > 0) {
+      buffer = buffer_create(output->device, width, height,
+        SCANOUT_FORMAT, modifiers, num_modifiers);
+
+      // a layout both sides list can still fail to allocate or import, the
+      // whole swapchain falls back so every buffer shares one layout
+      if (!buffer && i == 0) {
+        fprintf(stderr, "Tiled buffers failed for output %d, using linear\n",
+          output->connector_id);
+        num_modifiers = 0;
+      }
+    }
+
+    if (!buffer && num_modifiers == 0) {
+      buffer = buffer_create(output->device, width, height, SCANOUT_FORMAT, &linear, 1);
+    }
+
+    if (!buffer) {
+      fprintf(stderr, "Failed to create swapchain buffer %d for output %d\n",
+        i, output->connector_id);
+      goto err;
+    }
+
+    ret->buffers[ret->num_buffers++] = buffer;
+  }
+
+  if (!create_uniforms(ret, output->device->vk_device)) {
+    fprintf(stderr, "Failed to create the frame uniforms of output %d\n", output->connector_id);
+    goto err;
+  }
+
+  printf("Created %d %ux%u buffers for output %d\n", ret->num_buffers,
+    width, height, output->connector_id);
+
+  return ret;
+
+err:
+  swapchain_destroy(ret);
+  return NULL;
+}
+
+void swapchain_destroy(struct swapchain *swapchain)
+{
+  struct vk_device *vk_dev = swapchain->output->device->vk_device;
+
+  for (int i = 0; i < swapchain->num_buffers; i++) {
+    buffer_destroy(swapchain->buffers[i]);
+  }
+
+  for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
+    vk_arena_finish(&swapchain->arenas[i]);
+  }
+
+  if (swapchain->descriptor_set) {
+    vkFreeDescriptorSets(vk_dev->device, vk_dev->descriptor_pool, 1, &swapchain->descriptor_set);
+  }
+
+  if (swapchain->instance_buffer) {
+    vk_memory_destroy_buffer(vk_dev->memory, swapchain->instance_buffer,
+      &swapchain->instance_allocation);
+  }
+
+  if (swapchain->uniform_buffer) {
+    vk_memory_destroy_buffer(vk_dev->memory, swapchain->uniform_buffer,
+      &swapchain->uniform_allocation);
+  }
+
+  free(swapchain);
+}
+
+struct buffer *swapchain_acquire(struct swapchain *swapchain)
+{
+  for (int i = 0; i < swapchain->num_buffers; i++) {
+    int index = (swapchain->next + i) % swapchain->num_buffers;
+    struct buffer *buffer = swapchain->buffers[index];
+
+    // everything but the front buffer can be rendered into, buffers still on
+    // screen carry a release fence the GPU waits on before writing
+    if (buffer != swapchain->front && buffer_is_idle(buffer)) {
+      swapchain->next = (index + 1) % swapchain->num_buffers;
+      // the last frame rendered into it retired along with its allocations
+      vk_arena_reset(&swapchain->arenas[index]);
+      return buffer;
+    }
+  }
+
+  return NULL;
+}
+
+int swapchain_index(struct swapchain *swapchain, struct buffer *buffer)
+{
+  for (int i = 0; i < swapchain->num_buffers; i++) {
+    if (swapchain->buffers[i] == buffer) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+struct vk_arena *swapchain_arena(struct swapchain *swapchain, struct buffer *buffer)
+{
+  int index = swapchain_index(swapchain, buffer);
+  return index < 0 ? NULL : &swapchain->arenas[index];
+}
+
+void swapchain_buffer_damage(struct swapchain *swapchain, struct buffer *buffer,
+  const struct damage *frame_damage, struct damage *buffer_damage)
+{
+  uint32_t width = buffer->dmabuf.width;
+  uint32_t height = buffer->dmabuf.height;
+
+  damage_clear(buffer_damage);
+
+  // contents are undefined or older than the history goes back
+  if (buffer->age == 0 || buffer->age > BUFFER_QUEUE_DEPTH) {
+    damage_add_rect(buffer_damage, 0, 0, width, height);
+    return;
+  }
+
+  damage_add(buffer_damage, frame_damage);
+
+  // a buffer of age n missed the n - 1 frames queued after it
+  for (int i = 0; i < buffer->age - 1; i++) {
+    damage_add(buffer_damage, &swapchain->history[i]);
+  }
+
+  damage_clip(buffer_damage, width, height);
+}
+
+void swapchain_queue(struct swapchain *swapchain, struct buffer *buffer, int release_fence_fd,
+  const struct damage *frame_damage)
+{
+  struct buffer *previous = swapchain->front;
+
+  if (previous) {
+    if (previous->release_fence_fd >= 0) {
+      close(previous->release_fence_fd);
+    }
+    previous->release_fence_fd = release_fence_fd;
+  } else if (release_fence_fd >= 0) {
+    close(release_fence_fd);
+  }
+
+  swapchain->front = buffer;
+
+  for (int i = BUFFER_QUEUE_DEPTH - 1; i > 0; i--) {
+    swapchain->history[i] = swapchain->history[i - 1];
+  }
+  swapchain->history[0] = *frame_damage;
+
+  for (int i = 0; i < swapchain->num_buffers; i++) {
+    // stop counting once the buffer is older than the history
+    struct buffer *other = swapchain->buffers[i];
+    if (other->age > 0 && other->age <= BUFFER_QUEUE_DEPTH) {
+      other->age++;
+    }
+  }
+  buffer->age = 1;
+}
+
+void swapchain_bypass(struct swapchain *swapchain, int release_fence_fd)
+{
+  struct buffer *previous = swapchain->front;
+
+  if (previous) {
+    if (previous->release_fence_fd >= 0) {
+      close(previous->release_fence_fd);
+    }
+    previous->release_fence_fd = release_fence_fd;
+  } else if (release_fence_fd >= 0) {
+    close(release_fence_fd);
+  }
+
+  swapchain->front = NULL;
+
+  // the screen moved on without the history, so the next frame redraws
+  // every buffer in full
+  for (int i = 0; i < swapchain->num_buffers; i++) {
+    swapchain->buffers[i]->age = 0;
+  }
+}
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+
+#include "telemetry.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "clock.h"
+#include "device.h"
+#include "output.h"
+#include "vk_device.h"
+#include "vk_memory.h"
+#include "vk_staging.h"
+
+#define TELEMETRY_SOCKET_NAME "gfx-telemetry"
+
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+void telemetry_init(struct telemetry *telemetry, int64_t refresh_nsec)
+{
+  memset(telemetry, 0, sizeof(*telemetry));
+  telemetry->refresh_nsec = refresh_nsec;
+}
+
+static void histogram_add(struct histogram *histogram, int64_t nsec)
+{
+  if (nsec < 0) {
+    return;
+  }
+
+  int64_t bucket = nsec / (TELEMETRY_BUCKET_USEC * NSEC_PER_USEC);
+  if (bucket >= TELEMETRY_NUM_BUCKETS) {
+    bucket = TELEMETRY_NUM_BUCKETS - 1;
+  }
+
+  atomic_fetch_add_explicit(&histogram->counts[bucket], 1, memory_order_relaxed);
+}
+
+void telemetry_idle(struct telemetry *telemetry)
+{
+  telemetry->last_flip_nsec = 0;
+}
+
+void telemetry_frame(struct telemetry *telemetry, const struct frame_timings *timings)
+{
+  uint64_t frame = atomic_load_explicit(&telemetry->frames, memory_order_relaxed) + 1;
+  struct frame_record *record = &telemetry->ring[(frame - 1) % TELEMETRY_RING_SIZE];
+
+  // readers seeing seq change underneath them drop the copy they made
+  atomic_store_explicit(&record->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  record->timings = *timings;
+  atomic_store_explicit(&record->seq, frame, memory_order_release);
+  atomic_store_explicit(&telemetry->frames, frame, memory_order_release);
+
+  int64_t refresh = telemetry->refresh_nsec;
+
+  if (telemetry->last_flip_nsec != 0 && timings->flip_nsec != 0) {
+    int64_t frame_time = timings->flip_nsec - telemetry->last_flip_nsec;
+    histogram_add(&telemetry->frame_time, frame_time);
+
+    // flips more than half a refresh late landed on a later vblank
+    if (!telemetry->vrr && frame_time > refresh + refresh / 2) {
+      uint64_t missed = (frame_time + refresh / 2) / refresh - 1;
+      atomic_fetch_add_explicit(&telemetry->missed_vblanks, missed, memory_order_relaxed);
+    }
+  }
+
+  if (timings->flip_nsec != 0) {
+    histogram_add(&telemetry->latency, timings->flip_nsec - timings->start_nsec);
+    telemetry->last_flip_nsec = timings->flip_nsec;
+  }
+}
+
+int telemetry_copy_frames(struct telemetry *telemetry, struct frame_timings *frames)
+{
+  uint64_t last = atomic_load_explicit(&telemetry->frames, memory_order_acquire);
+  uint64_t first = last > TELEMETRY_RING_SIZE ? last - TELEMETRY_RING_SIZE + 1 : 1;
+
+  int n = 0;
+
+  for (uint64_t frame = first; frame <= last; frame++) {
+    struct frame_record *record = &telemetry->ring[(frame - 1) % TELEMETRY_RING_SIZE];
+
+    if (atomic_load_explicit(&record->seq, memory_order_acquire) != frame) {
+      continue;
+    }
+
+    struct frame_timings copy = record->timings;
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&record->seq, memory_order_relaxed) != frame) {
+      continue;
+    }
+
+    frames[n++] = copy;
+  }
+
+  return n;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+  int64_t lhs = *(const int64_t *)a;
+  int64_t rhs = *(const int64_t *)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+// p50, p99 and max in microseconds of the non-negative values
+static void write_stats(FILE *out, const char *name, int64_t *values, int count)
+{
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    if (values[i] >= 0) {
+      values[n++] = values[i];
+    }
+  }
+
+  fprintf(out, "\"%s\":", name);
+
+  if (n == 0) {
+    fprintf(out, "null");
+    return;
+  }
+
+  qsort(values, n, sizeof(values[0]), compare_int64);
+
+  fprintf(out, "{\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}",
+    (double)values[(n - 1) * 50 / 100] / NSEC_PER_USEC,
+    (double)values[(n - 1) * 99 / 100] / NSEC_PER_USEC,
+    (double)values[n - 1] / NSEC_PER_USEC);
+}
+
+// non-empty buckets only, as [lower bound in microseconds, count] pairs
+static void write_histogram(FILE *out, const char *name, struct histogram *histogram)
+{
+  fprintf(out, "\"%s\":[", name);
+
+  bool first = true;
+  for (int i = 0; i < TELEMETRY_NUM_BUCKETS; i++) {
+    uint64_t count = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    if (count == 0) {
+      continue;
+    }
+
+    fprintf(out, "%s[%d,%llu]", first ? "" : ",", i * TELEMETRY_BUCKET_USEC,
+      (unsigned long long)count);
+    first = false;
+  }
+
+  fprintf(out, "]");
+}
+
+static void write_output(FILE *out, struct output *output)
+{
+  struct telemetry *telemetry = &output->telemetry;
+
+  struct frame_timings frames[TELEMETRY_RING_SIZE];
+  int64_t values[TELEMETRY_RING_SIZE];
+
+  int n = telemetry_copy_frames(telemetry, frames);
+
+  fprintf(out, "{\"connector\":%u,\"refresh_nsec\":%lld,\"frames\":%llu,"
+    "\"missed_vblanks\":%llu,\"window\":%d,",
+    output->connector_id, (long long)telemetry->refresh_nsec,
+    (unsigned long long)atomic_load(&telemetry->frames),
+    (unsigned long long)atomic_load(&telemetry->missed_vblanks), n);
+
+  int count = 0;
+  for (int i = 1; i < n; i++) {
+    values[count++] = frames[i].flip_nsec && frames[i - 1].flip_nsec ?
+      frames[i].flip_nsec - frames[i - 1].flip_nsec : -1;
+  }
+  write_stats(out, "frame_time_usec", values, count);
+  fprintf(out, ",");
+
+  for (int i = 0; i < n; i++) {
+    values[i] = frames[i].flip_nsec ? frames[i].flip_nsec - frames[i].start_nsec : -1;
+  }
+  write_stats(out, "latency_usec", values, n);
+  fprintf(out, ",");
+
+  for (int i = 0; i < n; i++) {
+    values[i] = frames[i].record_nsec ? frames[i].record_nsec - frames[i].start_nsec : -1;
+  }
+  write_stats(out, "cpu_record_usec", values, n);
+  fprintf(out, ",");
+
+  for (int i = 0; i < n; i++) {
+    values[i] = frames[i].gpu_done_nsec && frames[i].submit_nsec ?
+      frames[i].gpu_done_nsec - frames[i].submit_nsec : -1;
+  }
+  write_stats(out, "gpu_usec", values, n);
+  fprintf(out, ",");
+
+  write_histogram(out, "frame_time_histogram", &telemetry->frame_time);
+  fprintf(out, ",");
+  write_histogram(out, "latency_histogram", &telemetry->latency);
+
+  struct plane_cache_stats *plane_tests = &output->planes.cache.stats;
+  fprintf(out, ",\"plane_tests\":{\"cached\":%llu,\"committed\":%llu}",
+    (unsigned long long)plane_tests->hits, (unsigned long long)plane_tests->misses);
+
+  fprintf(out, "}");
+}
+
+static void write_memory(FILE *out, struct vk_memory *memory)
+{
+  struct vk_memory_stats *stats = &memory->stats;
+
+  fprintf(out, "\"memory\":{\"blocks\":%u,\"dedicated\":%u,\"allocations\":%u,"
+    "\"reserved\":%llu,\"allocated\":%llu,\"requested\":%llu},",
+    stats->blocks, stats->dedicated, stats->allocations,
+    (unsigned long long)stats->reserved, (unsigned long long)stats->allocated,
+    (unsigned long long)stats->requested);
+}
+
+static void write_staging(FILE *out, struct vk_staging *staging)
+{
+  struct vk_staging_stats *stats = &staging->stats;
+
+  fprintf(out, "\"staging\":{\"uploads\":%llu,\"bytes\":%llu,\"batches\":%llu,"
+    "\"rejected\":%llu},",
+    (unsigned long long)stats->uploads, (unsigned long long)stats->bytes,
+    (unsigned long long)stats->batches, (unsigned long long)stats->rejected);
+}
+
+char *telemetry_json(struct device *device, size_t *size)
+{
+  char *ret = NULL;
+  FILE *out = open_memstream(&ret, size);
+  if (!out) {
+    return NULL;
+  }
+
+  fprintf(out, "{\"timestamp_nsec\":%lld,\"bucket_usec\":%d,",
+    (long long)clock_now_nsec(), TELEMETRY_BUCKET_USEC);
+
+  if (device->vk_device && device->vk_device->memory) {
+    write_memory(out, device->vk_device->memory);
+  }
+
+  if (device->vk_device && device->vk_device->staging) {
+    write_staging(out, device->vk_device->staging);
+  }
+
+  fprintf(out, "\"outputs\":[");
+
+  for (int i = 0; i < device->num_outputs; i++) {
+    if (i > 0) {
+      fprintf(out, ",");
+    }
+    write_output(out, device->outputs[i]);
+  }
+
+  fprintf(out, "]}\n");
+  fclose(out);
+
+  return ret;
+}
+
+int telemetry_listen(void)
+{
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!runtime_dir || runtime_dir[0] != '/') {
+    return -1;
+  }
+
+  int len = snprintf(socket_path, sizeof(socket_path), "%s/%s", runtime_dir,
+    TELEMETRY_SOCKET_NAME);
+  if (len < 0 || (size_t)len >= sizeof(socket_path)) {
+    socket_path[0] = '\0';
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't create telemetry socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, socket_path, len + 1);
+
+  // left behind by an earlier instance that didn't shut down cleanly
+  unlink(socket_path);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+    fprintf(stderr, "Couldn't listen on %s: %s\n", socket_path, strerror(errno));
+    close(fd);
+    socket_path[0] = '\0';
+    return -1;
+  }
+
+  printf("Serving telemetry on %s\n", socket_path);
+
+  return fd;
+}
+
+void telemetry_serve(struct device *device, int listen_fd)
+{
+  // the frame loop never waits on a client, one that doesn't read gets what
+  // fits into its socket buffer and nothing more
+  int client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client < 0) {
+    return;
+  }
+
+  size_t size = 0;
+  char *json = telemetry_json(device, &size);
+
+  // best effort, the kernel caps it at wmem_max
+  int sndbuf = size < INT_MAX ? (int)size : INT_MAX;
+  setsockopt(client, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  size_t written = 0;
+  while (json && written < size) {
+    ssize_t ret = send(client, json + written, size - written, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        fprintf(stderr, "Telemetry client isn't reading, dropped %zu bytes\n",
+          size - written);
+      }
+      break;
+    }
+    written += ret;
+  }
+
+  free(json);
+  close(client);
+}
+
+void telemetry_close(int listen_fd)
+{
+  if (listen_fd < 0) {
+    return;
+  }
+
+  close(listen_fd);
+
+  if (socket_path[0]) {
+    unlink(socket_path);
+  }
+}
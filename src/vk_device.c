@@ -1,19 +1,27 @@
+#define _GNU_SOURCE
+
 #include "vk_device.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <vulkan/vulkan.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
+#include <compose.comp.h>
 #include <shader.frag.h>
 #include <shader.vert.h>
 
 #include "device.h"
-
-#define BUFFER_QUEUE_DEPTH 3
+#include "pipeline_cache.h"
+#include "profiler.h"
+#include "vk_memory.h"
+#include "vk_staging.h"
 
 static const VkFormat swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
 
@@ -94,7 +102,7 @@ static bool locateValidationLayer(const char *layer_name)
   return false;
 }
 
-static void create_instance(struct vk_device *vk_dev)
+static VkInstance create_instance(void)
 {
   VkResult res;
 
@@ -110,8 +118,8 @@ static void create_instance(struct vk_device *vk_dev)
   VkInstanceCreateInfo instance_info = {
     .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
     .pApplicationInfo = &appInfo,
-    .enabledExtensionCount = vk_dev->enabled_extensions_count,
-    .ppEnabledExtensionNames = vk_dev->enabled_extensions,
+    .enabledExtensionCount = 0,
+    .ppEnabledExtensionNames = NULL,
   };
 
   const char *vk_layer_khronos_validation = "VK_LAYER_KHRONOS_validation";
@@ -129,11 +137,14 @@ static void create_instance(struct vk_device *vk_dev)
     instance_info.enabledLayerCount = 0;
   }
 
-  res = vkCreateInstance(&instance_info, NULL, &vk_dev->instance);
+  VkInstance instance = VK_NULL_HANDLE;
+  res = vkCreateInstance(&instance_info, NULL, &instance);
   if (res != VK_SUCCESS) {
     printf("Failed to create Vulkan instance\n");
-    return;
+    return VK_NULL_HANDLE;
   }
+
+  return instance;
 }
 
 bool device_has_extension(VkPhysicalDevice physical_device, const char *extension_name)
@@ -162,30 +173,9 @@ bool device_has_extension(VkPhysicalDevice physical_device, const char *extensio
   return has_extension;
 }
 
-static bool device_matches(drmPciBusInfoPtr pci_bus_info, VkPhysicalDevice physical_device)
+static void print_device(struct vk_physical_device_info *info)
 {
-  bool has_pci_extension = device_has_extension(physical_device,
-    VK_EXT_PCI_BUS_INFO_EXTENSION_NAME);
-
-  if (!has_pci_extension) {
-    fprintf(stderr, "Physical device has not support for VK_EXT_pci_bus_info\n");
-    return false;
-  }
-
-  VkPhysicalDevicePCIBusInfoPropertiesEXT pci_props = {0};
-  pci_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PCI_BUS_INFO_PROPERTIES_EXT;
-
-  VkPhysicalDeviceProperties2 physical_device_props = {0};
-  physical_device_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
-  physical_device_props.pNext = &pci_props;
-
-  vkGetPhysicalDeviceProperties2(physical_device, &physical_device_props);
-  bool match = pci_props.pciBus == pci_bus_info->bus &&
-    pci_props.pciDevice == pci_bus_info->dev &&
-    pci_props.pciDomain == pci_bus_info->domain &&
-    pci_props.pciFunction == pci_bus_info->func;
-
-  VkPhysicalDeviceProperties *props = &physical_device_props.properties;
+  VkPhysicalDeviceProperties *props = &info->props;
   uint32_t vv_major = (props->apiVersion >> 22);
   uint32_t vv_minor = (props->apiVersion >> 12) & 0x3ff;
   uint32_t vv_patch = (props->apiVersion) & 0xfff;
@@ -217,52 +207,249 @@ static bool device_matches(drmPciBusInfoPtr pci_bus_info, VkPhysicalDevice physi
   printf("  Device type: '%s'\n", dev_type);
   printf("  Supported API version: %u.%u.%u\n", vv_major, vv_minor, vv_patch);
   printf("  Driver version: %u.%u.%u\n", dv_major, dv_minor, dv_patch);
+}
+
+static bool device_matches(drmPciBusInfoPtr pci_bus_info, struct vk_physical_device_info *info)
+{
+  if (!info->has_pci_bus_info) {
+    fprintf(stderr, "Physical device has not support for VK_EXT_pci_bus_info\n");
+    return false;
+  }
+
+  VkPhysicalDevicePCIBusInfoPropertiesEXT *pci_props = &info->pci_bus_info;
+
+  bool match = pci_props->pciBus == pci_bus_info->bus &&
+    pci_props->pciDevice == pci_bus_info->dev &&
+    pci_props->pciDomain == pci_bus_info->domain &&
+    pci_props->pciFunction == pci_bus_info->func;
+
+  print_device(info);
   printf("  match: %d\n", match);
 
   return match;
 }
 
-static VkPhysicalDevice find_pci_device(VkInstance instance, drmPciBusInfoPtr pci)
+// the device number of a DRM node, 0 when it can't be stat'ed
+static dev_t node_rdev(const char *path)
 {
-  VkResult res;
+  struct stat st;
+  if (!path || stat(path, &st) != 0) {
+    return 0;
+  }
+
+  return st.st_rdev;
+}
+
+static bool node_matches(dev_t rdev, int64_t node_major, int64_t node_minor)
+{
+  return rdev != 0 && major(rdev) == node_major && minor(rdev) == node_minor;
+}
+
+// matches on the DRM nodes themselves, which works for any bus
+static VkPhysicalDevice find_drm_device(struct vk_probe *probe, drmDevicePtr drm_device)
+{
+  dev_t primary = 0;
+  dev_t render = 0;
+
+  if (drm_device->available_nodes & (1 << DRM_NODE_PRIMARY)) {
+    primary = node_rdev(drm_device->nodes[DRM_NODE_PRIMARY]);
+  }
+  if (drm_device->available_nodes & (1 << DRM_NODE_RENDER)) {
+    render = node_rdev(drm_device->nodes[DRM_NODE_RENDER]);
+  }
+
+  for (uint32_t i = 0; i < probe->num_devices; i++) {
+    struct vk_physical_device_info *info = &probe->devices[i];
+    if (!info->has_drm_props) {
+      continue;
+    }
+
+    VkPhysicalDeviceDrmPropertiesEXT *drm = &info->drm_props;
+    bool match =
+      (drm->hasPrimary && node_matches(primary, drm->primaryMajor, drm->primaryMinor)) ||
+      (drm->hasRender && node_matches(render, drm->renderMajor, drm->renderMinor));
+
+    if (match) {
+      print_device(info);
+      printf("  match: drm node\n");
+      return info->physical_device;
+    }
+  }
+
+  return VK_NULL_HANDLE;
+}
+
+static VkPhysicalDevice find_pci_device(struct vk_probe *probe, drmPciBusInfoPtr pci)
+{
+  printf("PCI bus: %04x:%02x:%02x.%x\n", pci->domain, pci->bus, pci->dev, pci->func);
+
+  for (uint32_t i = 0; i < probe->num_devices; i++) {
+    if (device_matches(pci, &probe->devices[i])) {
+      return probe->devices[i].physical_device;
+    }
+  }
+
+  fprintf(stderr, "Can't find vulkan physical device for drm dev\n");
+
+  return VK_NULL_HANDLE;
+}
+
+static int device_type_rank(VkPhysicalDeviceType type)
+{
+  switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+      return 4;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+      return 3;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+      return 2;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// no Vulkan device drives the KMS device, e.g. display-only devices such as
+// vkms or a display controller next to a separate GPU, so render on the most
+// capable device and share the buffers with the KMS device
+static VkPhysicalDevice find_prime_device(struct vk_probe *probe)
+{
+  struct vk_physical_device_info *best = NULL;
+
+  for (uint32_t i = 0; i < probe->num_devices; i++) {
+    struct vk_physical_device_info *info = &probe->devices[i];
+    if (!best || device_type_rank(info->props.deviceType) >
+      device_type_rank(best->props.deviceType))
+    {
+      best = info;
+    }
+  }
+
+  if (!best) {
+    fprintf(stderr, "No vulkan device to render for the drm dev\n");
+    return VK_NULL_HANDLE;
+  }
+
+  print_device(best);
+  printf("  match: prime\n");
 
-  VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+  return best->physical_device;
+}
+
+static void enumerate_physical_devices(struct vk_probe *probe)
+{
+  VkResult res;
 
   uint32_t physical_device_count = 0;
-  res = vkEnumeratePhysicalDevices(instance, &physical_device_count, NULL);
+  res = vkEnumeratePhysicalDevices(probe->instance, &physical_device_count, NULL);
   if (res != VK_SUCCESS || physical_device_count == 0) {
     fprintf(stderr, "Could not retrieve physical device\n");
-    goto error;
+    return;
   }
 
   VkPhysicalDevice *physical_devices = calloc(physical_device_count, sizeof(VkPhysicalDevice));
-  res = vkEnumeratePhysicalDevices(instance, &physical_device_count, physical_devices);
+  assert(physical_devices);
+
+  res = vkEnumeratePhysicalDevices(probe->instance, &physical_device_count, physical_devices);
   if (res != VK_SUCCESS || physical_device_count == 0) {
     fprintf(stderr, "Could not retrieve physical device");
     goto error;
   }
 
-  printf("PCI bus: %04x:%02x:%02x.%x\n", pci->domain, pci->bus, pci->dev, pci->func);
+  probe->devices = calloc(physical_device_count, sizeof(*probe->devices));
+  assert(probe->devices);
 
+  for (uint32_t i = 0; i < physical_device_count; i++) {
+    struct vk_physical_device_info *info = &probe->devices[i];
+    info->physical_device = physical_devices[i];
+    info->has_pci_bus_info = device_has_extension(info->physical_device,
+      VK_EXT_PCI_BUS_INFO_EXTENSION_NAME);
+    info->has_drm_props = device_has_extension(info->physical_device,
+      VK_EXT_PHYSICAL_DEVICE_DRM_EXTENSION_NAME);
 
-  for (unsigned i = 0u; i < physical_device_count; i++) {
-    VkPhysicalDevice temp_physical_device = physical_devices[i];
-    bool match = device_matches(pci, temp_physical_device);
-    if (match) {
-      physical_device = temp_physical_device;
-      break;
+    VkPhysicalDeviceProperties2 props = {0};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+
+    info->pci_bus_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PCI_BUS_INFO_PROPERTIES_EXT;
+    if (info->has_pci_bus_info) {
+      info->pci_bus_info.pNext = props.pNext;
+      props.pNext = &info->pci_bus_info;
     }
-  }
 
-  if (physical_device == VK_NULL_HANDLE) {
-    fprintf(stderr, "Can't find vulkan physical device for drm dev\n");
-    goto error;
+    info->drm_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRM_PROPERTIES_EXT;
+    if (info->has_drm_props) {
+      info->drm_props.pNext = props.pNext;
+      props.pNext = &info->drm_props;
+    }
+
+    vkGetPhysicalDeviceProperties2(info->physical_device, &props);
+
+    info->props = props.properties;
+    info->pci_bus_info.pNext = NULL;
+    info->drm_props.pNext = NULL;
   }
 
+  probe->num_devices = physical_device_count;
+
 error:
   free(physical_devices);
+}
+
+static void *probe_run(void *data)
+{
+  struct vk_probe *probe = data;
 
-  return physical_device;
+  int stage = profiler_begin("vulkan instance");
+  probe->instance = create_instance();
+  profiler_end(stage);
+
+  if (probe->instance) {
+    stage = profiler_begin("vulkan physical devices");
+    enumerate_physical_devices(probe);
+    profiler_end(stage);
+  }
+
+  return NULL;
+}
+
+struct vk_probe *vk_probe_start(void)
+{
+  struct vk_probe *ret = calloc(1, sizeof(*ret));
+  assert(ret);
+
+  if (pthread_create(&ret->thread, NULL, probe_run, ret) == 0) {
+    ret->threaded = true;
+  } else {
+    fprintf(stderr, "Couldn't start Vulkan probe thread, probing inline\n");
+    probe_run(ret);
+    ret->done = true;
+  }
+
+  return ret;
+}
+
+bool vk_probe_wait(struct vk_probe *probe)
+{
+  if (!probe->done) {
+    pthread_join(probe->thread, NULL);
+    probe->done = true;
+  }
+
+  return probe->num_devices > 0;
+}
+
+void vk_probe_destroy(struct vk_probe *probe)
+{
+  vk_probe_wait(probe);
+
+  free(probe->devices);
+
+  if (probe->instance) {
+    vkDestroyInstance(probe->instance, NULL);
+  }
+
+  free(probe);
 }
 
 static bool check_memory_extensions(VkPhysicalDevice physical_device)
@@ -293,6 +480,23 @@ static bool check_memory_extensions(VkPhysicalDevice physical_device)
   return true;
 }
 
+static bool check_sync_fd_semaphores(VkPhysicalDevice physical_device)
+{
+  VkPhysicalDeviceExternalSemaphoreInfo info = {0};
+  info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO;
+  info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+  VkExternalSemaphoreProperties props = {0};
+  props.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES;
+
+  vkGetPhysicalDeviceExternalSemaphoreProperties(physical_device, &info, &props);
+
+  VkExternalSemaphoreFeatureFlags required = VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT |
+    VK_EXTERNAL_SEMAPHORE_FEATURE_IMPORTABLE_BIT;
+
+  return (props.externalSemaphoreFeatures & required) == required;
+}
+
 static void locate_queue_families(struct vk_device *ret)
 {
   uint32_t queue_family_count;
@@ -300,33 +504,127 @@ static void locate_queue_families(struct vk_device *ret)
 
   VkQueueFamilyProperties *queue_family_properties = calloc(queue_family_count,
     sizeof(VkQueueFamilyProperties));
+  assert(queue_family_properties);
 
   vkGetPhysicalDeviceQueueFamilyProperties(ret->physical_device,
     &queue_family_count, queue_family_properties);
 
-  uint32_t queue_family = -1;
+  uint32_t graphics = UINT32_MAX;
+  uint32_t compute = UINT32_MAX;
+  uint32_t transfer = UINT32_MAX;
 
   for (uint32_t i = 0; i < queue_family_count; i++) {
-    if (queue_family_properties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-      ret->queue_family = i;
-      break;
+    VkQueueFlags flags = queue_family_properties[i].queueFlags;
+
+    if (graphics == UINT32_MAX && (flags & VK_QUEUE_GRAPHICS_BIT)) {
+      graphics = i;
+    } else if (compute == UINT32_MAX && (flags & VK_QUEUE_COMPUTE_BIT) &&
+      !(flags & VK_QUEUE_GRAPHICS_BIT))
+    {
+      compute = i;
+    } else if (transfer == UINT32_MAX && (flags & VK_QUEUE_TRANSFER_BIT) &&
+      !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+    {
+      transfer = i;
+    }
+  }
+
+  free(queue_family_properties);
+
+  assert(graphics != UINT32_MAX);
+
+  ret->queue_family = graphics;
+  // graphics families always support compute and transfer as well
+  ret->compute_queue_family = compute != UINT32_MAX ? compute : graphics;
+  ret->transfer_queue_family = transfer != UINT32_MAX ? transfer : graphics;
+
+  printf("Queue families: graphics %u, compute %u, transfer %u\n", ret->queue_family,
+    ret->compute_queue_family, ret->transfer_queue_family);
+}
+
+static bool want_compute_composition(void)
+{
+  const char *env = getenv("GFX_COMPUTE_COMPOSITION");
+  return env && strcmp(env, "1") == 0;
+}
+
+static bool supports_compute_composition(VkPhysicalDevice physical_device)
+{
+  if (!device_has_extension(physical_device, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME)) {
+    fprintf(stderr, "Compute composition needs %s\n", VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    return false;
+  }
+
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(physical_device, &features);
+  if (!features.shaderStorageImageWriteWithoutFormat) {
+    fprintf(stderr, "Compute composition needs shaderStorageImageWriteWithoutFormat\n");
+    return false;
+  }
+
+  // linear is what every swapchain can fall back to
+  VkDrmFormatModifierPropertiesListEXT list = {0};
+  list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+
+  VkFormatProperties2 props = {0};
+  props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+  props.pNext = &list;
+
+  vkGetPhysicalDeviceFormatProperties2(physical_device, VK_DEVICE_STORAGE_FORMAT, &props);
+
+  VkDrmFormatModifierPropertiesEXT *modifiers = calloc(list.drmFormatModifierCount + 1,
+    sizeof(*modifiers));
+  assert(modifiers);
+
+  list.pDrmFormatModifierProperties = modifiers;
+  vkGetPhysicalDeviceFormatProperties2(physical_device, VK_DEVICE_STORAGE_FORMAT, &props);
+
+  bool linear_storage = false;
+  for (uint32_t i = 0; i < list.drmFormatModifierCount; i++) {
+    if (modifiers[i].drmFormatModifier == DRM_FORMAT_MOD_LINEAR &&
+      (modifiers[i].drmFormatModifierTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT))
+    {
+      linear_storage = true;
     }
   }
 
-  assert(queue_family);
+  free(modifiers);
+
+  if (!linear_storage) {
+    fprintf(stderr, "Compute composition needs linear storage images\n");
+    return false;
+  }
+
+  return true;
 }
 
-static void pick_physical_device(struct device* device, struct vk_device *vk_dev)
+static bool pick_physical_device(struct device* device, struct vk_probe *probe,
+  struct vk_device *vk_dev)
 {
   drmDevicePtr drm_device;
-  drmGetDevice(device->kms_fd, &drm_device);
-  if (drm_device->bustype != DRM_BUS_PCI) {
-    fprintf(stderr, "Given device isn't a pci device\n");
+  if (drmGetDevice(device->kms_fd, &drm_device) != 0) {
+    fprintf(stderr, "Couldn't get drm device info\n");
     goto error;
   }
 
-  vk_dev->physical_device = find_pci_device(vk_dev->instance, drm_device->businfo.pci);
-  assert(vk_dev->physical_device);
+  vk_dev->physical_device = find_drm_device(probe, drm_device);
+
+  if (!vk_dev->physical_device && drm_device->bustype == DRM_BUS_PCI) {
+    vk_dev->physical_device = find_pci_device(probe, drm_device->businfo.pci);
+  }
+
+  if (!vk_dev->physical_device) {
+    vk_dev->physical_device = find_prime_device(probe);
+    vk_dev->prime = vk_dev->physical_device != VK_NULL_HANDLE;
+  }
+
+  drmFreeDevice(&drm_device);
+
+  // the next KMS device may have one
+  if (!vk_dev->physical_device) {
+    fprintf(stderr, "No Vulkan device can render for this KMS device\n");
+    goto error;
+  }
 
   bool has_memory_extensions = check_memory_extensions(vk_dev->physical_device);
   if (!has_memory_extensions) {
@@ -342,23 +640,51 @@ static void pick_physical_device(struct device* device, struct vk_device *vk_dev
     goto error;
   }
 
+  if (!check_sync_fd_semaphores(vk_dev->physical_device)) {
+    fprintf(stderr, "Physical device can't import and export sync_file semaphores\n");
+    goto error;
+  }
+
   locate_queue_families(vk_dev);
 
+  vk_dev->compute_composition = want_compute_composition() &&
+    supports_compute_composition(vk_dev->physical_device);
+
+  return true;
+
 error:
-  return;
+  return false;
 }
 
-static void create_logical_device(struct vk_device *vk_dev)
+static bool create_logical_device(struct vk_device *vk_dev)
 {
   VkResult res;
 
   float priority = 1.0f;
 
-  VkDeviceQueueCreateInfo queue_info = {0};
-  queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queue_info.queueFamilyIndex = vk_dev->queue_family;
-  queue_info.queueCount = 1;
-  queue_info.pQueuePriorities = &priority;
+  // one queue per distinct family
+  uint32_t families[] = {
+    vk_dev->queue_family, vk_dev->compute_queue_family, vk_dev->transfer_queue_family
+  };
+
+  VkDeviceQueueCreateInfo queue_infos[3] = {0};
+  uint32_t queue_info_count = 0;
+
+  for (int i = 0; i < 3; i++) {
+    bool seen = false;
+    for (uint32_t j = 0; j < queue_info_count; j++) {
+      seen |= queue_infos[j].queueFamilyIndex == families[i];
+    }
+    if (seen) {
+      continue;
+    }
+
+    VkDeviceQueueCreateInfo *queue_info = &queue_infos[queue_info_count++];
+    queue_info->sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_info->queueFamilyIndex = families[i];
+    queue_info->queueCount = 1;
+    queue_info->pQueuePriorities = &priority;
+  }
 
   const char* mem_exts[] = {
     VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
@@ -366,14 +692,25 @@ static void create_logical_device(struct vk_device *vk_dev)
     VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
     VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME,
     VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
+    // last, only enabled for compute composition
+    VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME,
   };
 
+  uint32_t mem_exts_count = sizeof(mem_exts) / sizeof(mem_exts[0]);
+  if (!vk_dev->compute_composition) {
+    mem_exts_count--;
+  }
+
+  VkPhysicalDeviceFeatures features = {0};
+  features.shaderStorageImageWriteWithoutFormat = vk_dev->compute_composition;
+
   VkDeviceCreateInfo device_info = {0};
   device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  device_info.queueCreateInfoCount = 1;
-  device_info.pQueueCreateInfos = &queue_info;
-  device_info.enabledExtensionCount = 4;
+  device_info.queueCreateInfoCount = queue_info_count;
+  device_info.pQueueCreateInfos = queue_infos;
+  device_info.enabledExtensionCount = mem_exts_count;
   device_info.ppEnabledExtensionNames = mem_exts;
+  device_info.pEnabledFeatures = &features;
 
   res = vkCreateDevice(vk_dev->physical_device, &device_info, NULL, &vk_dev->device);
   if (res != VK_SUCCESS){
@@ -382,16 +719,70 @@ static void create_logical_device(struct vk_device *vk_dev)
   }
 
   vkGetDeviceQueue(vk_dev->device, vk_dev->queue_family, 0, &vk_dev->queue);
+  vkGetDeviceQueue(vk_dev->device, vk_dev->compute_queue_family, 0, &vk_dev->compute_queue);
+  vkGetDeviceQueue(vk_dev->device, vk_dev->transfer_queue_family, 0, &vk_dev->transfer_queue);
+
+  vk_dev->get_memory_fd_properties = (PFN_vkGetMemoryFdPropertiesKHR)
+    vkGetDeviceProcAddr(vk_dev->device, "vkGetMemoryFdPropertiesKHR");
+  assert(vk_dev->get_memory_fd_properties);
+
+  vk_dev->get_semaphore_fd = (PFN_vkGetSemaphoreFdKHR)
+    vkGetDeviceProcAddr(vk_dev->device, "vkGetSemaphoreFdKHR");
+  assert(vk_dev->get_semaphore_fd);
+
+  vk_dev->import_semaphore_fd = (PFN_vkImportSemaphoreFdKHR)
+    vkGetDeviceProcAddr(vk_dev->device, "vkImportSemaphoreFdKHR");
+  assert(vk_dev->import_semaphore_fd);
+
+  if (vk_dev->compute_composition) {
+    vk_dev->push_descriptor_set = (PFN_vkCmdPushDescriptorSetKHR)
+      vkGetDeviceProcAddr(vk_dev->device, "vkCmdPushDescriptorSetKHR");
+    assert(vk_dev->push_descriptor_set);
+  }
+
+  return true;
 
 error:
-  return;
+  return false;
 }
 
 void vk_device_destroy(struct vk_device *device) {
-  if (device->instance) {
-    // vkDestroyInstance(device->instance, NULL);
+  if (device->device) {
+    vkDeviceWaitIdle(device->device);
+  }
+
+  if (device->staging) {
+    vk_staging_destroy(device->staging);
   }
 
+  if (device->memory) {
+    vk_memory_destroy(device->memory);
+  }
+
+  // destroying VK_NULL_HANDLE is a no-op, so half created devices need no
+  // special casing
+  if (device->device) {
+    VkDevice dev = device->device;
+
+    vkDestroyPipeline(dev, device->compose_pipeline, NULL);
+    vkDestroyPipelineLayout(dev, device->compose_layout, NULL);
+    vkDestroyDescriptorSetLayout(dev, device->compose_set_layout, NULL);
+    vkDestroySampler(dev, device->compose_sampler, NULL);
+
+    vkDestroyPipeline(dev, device->pipeline, NULL);
+    vkDestroyPipelineLayout(dev, device->pipeline_layout, NULL);
+    vkDestroyDescriptorSetLayout(dev, device->descriptor_set_layout, NULL);
+    vkDestroyRenderPass(dev, device->render_pass, NULL);
+    vkDestroyPipelineCache(dev, device->pipeline_cache, NULL);
+
+    vkDestroyDescriptorPool(dev, device->descriptor_pool, NULL);
+    vkDestroyCommandPool(dev, device->compute_command_pool, NULL);
+    vkDestroyCommandPool(dev, device->command_pool, NULL);
+
+    vkDestroyDevice(dev, NULL);
+  }
+
+  // the instance belongs to the vk_probe
   free(device);
 }
 
@@ -401,6 +792,8 @@ static void create_command_pool(struct vk_device *vk_dev)
 
   VkCommandPoolCreateInfo cpi = {0};
   cpi.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  // command buffers are kept across frames and only re-recorded, one at a
+  // time, when what they draw changes
   cpi.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
   cpi.queueFamilyIndex = vk_dev->queue_family;
 
@@ -411,6 +804,16 @@ static void create_command_pool(struct vk_device *vk_dev)
     goto error;
   }
 
+  if (vk_dev->compute_composition) {
+    cpi.queueFamilyIndex = vk_dev->compute_queue_family;
+
+    res = vkCreateCommandPool(vk_dev->device, &cpi, NULL, &vk_dev->compute_command_pool);
+    if (res != VK_SUCCESS) {
+      fprintf(stderr, "vkCreateCommandPool failed to create the compute pool");
+      vk_dev->compute_composition = false;
+    }
+  }
+
 error:
   return;
 }
@@ -419,15 +822,19 @@ static void create_descriptor_pool(struct vk_device *vk_dev)
 {
   VkResult res;
 
-  VkDescriptorPoolSize pool_size = {0};
-  pool_size.descriptorCount = BUFFER_QUEUE_DEPTH;
-  pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  VkDescriptorPoolSize pool_sizes[2] = {0};
+  pool_sizes[0].descriptorCount = VK_DEVICE_MAX_UNIFORM_SETS;
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  pool_sizes[1].descriptorCount = VK_DEVICE_MAX_UNIFORM_SETS;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 
   VkDescriptorPoolCreateInfo dpi = {0};
   dpi.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  dpi.maxSets = BUFFER_QUEUE_DEPTH;
-  dpi.poolSizeCount = 1;
-  dpi.pPoolSizes = &pool_size;
+  // swapchains hand their set back when an output goes away
+  dpi.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+  dpi.maxSets = VK_DEVICE_MAX_UNIFORM_SETS;
+  dpi.poolSizeCount = 2;
+  dpi.pPoolSizes = pool_sizes;
 
   res = vkCreateDescriptorPool(vk_dev->device, &dpi, NULL, &vk_dev->descriptor_pool);
 
@@ -445,11 +852,12 @@ static void create_render_pass(struct vk_device *vk_dev)
   VkAttachmentDescription attachment = {0};
   attachment.format = swapChainImageFormat;
   attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-  attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  // frames only redraw their damage on top of the buffer's previous contents
+  attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
   attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
   attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  attachment.initialLayout = VK_IMAGE_LAYOUT_GENERAL;
   attachment.finalLayout = VK_IMAGE_LAYOUT_GENERAL;
 
   VkAttachmentReference color_ref = {0};
@@ -479,20 +887,26 @@ error:
   return;
 }
 
-static void create_graphics_pipeline(struct vk_device *vk_dev)
+static bool create_pipeline_layout(struct vk_device *vk_dev)
 {
   VkResult res;
 
-  VkDescriptorSetLayoutBinding binding = {0};
-  binding.binding = 0;
-  binding.descriptorCount = 1;
-  binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  VkDescriptorSetLayoutBinding bindings[2] = {0};
+  bindings[0].binding = 0;
+  bindings[0].descriptorCount = 1;
+  // every draw picks its slice of the frame's uniforms with a dynamic offset
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  // quad instances, found through the draw's first instance instead
+  bindings[1].binding = 1;
+  bindings[1].descriptorCount = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[1].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
   VkDescriptorSetLayoutCreateInfo dli = {0};
   dli.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  dli.bindingCount = 1u;
-  dli.pBindings = &binding;
+  dli.bindingCount = 2u;
+  dli.pBindings = bindings;
 
   res = vkCreateDescriptorSetLayout(vk_dev->device, &dli, NULL, &vk_dev->descriptor_set_layout);
 
@@ -513,6 +927,17 @@ static void create_graphics_pipeline(struct vk_device *vk_dev)
     goto error;
   }
 
+  return true;
+
+error:
+  return false;
+}
+
+bool vk_device_create_pipeline(struct vk_device *vk_dev, VkPipelineCache cache,
+  VkPipeline *pipeline)
+{
+  VkResult res;
+
   VkShaderModule vert_module;
   VkShaderModule frag_module;
 
@@ -549,7 +974,8 @@ static void create_graphics_pipeline(struct vk_device *vk_dev)
   // info
   VkPipelineInputAssemblyStateCreateInfo assembly = {0};
   assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN;
+  // quads are 4 vertex strips, pulled from the instance buffer in the shader
+  assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
 
   VkPipelineRasterizationStateCreateInfo rasterization = {0};
   rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -608,9 +1034,7 @@ static void create_graphics_pipeline(struct vk_device *vk_dev)
   pipe_info.pDynamicState = &dynamic;
   pipe_info.pVertexInputState = &vertex;
 
-  // could use a cache here for faster loading
-  VkPipelineCache cache = VK_NULL_HANDLE;
-  res = vkCreateGraphicsPipelines(vk_dev->device, cache, 1, &pipe_info, NULL, &vk_dev->pipeline);
+  res = vkCreateGraphicsPipelines(vk_dev->device, cache, 1, &pipe_info, NULL, pipeline);
 
   vkDestroyShaderModule(vk_dev->device, vert_module, NULL);
   vkDestroyShaderModule(vk_dev->device, frag_module, NULL);
@@ -620,27 +1044,157 @@ static void create_graphics_pipeline(struct vk_device *vk_dev)
     goto error;
   }
 
+  return true;
+
 error:
-  return;
+  return false;
 }
 
-struct vk_device *vk_device_create(struct device *device)
+static bool create_compose_pipeline(struct vk_device *vk_dev)
+{
+  VkResult res;
+
+  VkSamplerCreateInfo sampler_info = {0};
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+
+  res = vkCreateSampler(vk_dev->device, &sampler_info, NULL, &vk_dev->compose_sampler);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateSampler failed: %d\n", res);
+    return false;
+  }
+
+  VkDescriptorSetLayoutBinding bindings[2] = {0};
+  bindings[0].binding = 0;
+  bindings[0].descriptorCount = 1;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[1].binding = 1;
+  bindings[1].descriptorCount = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  // pushed per layer, so there's no pool to size for every output
+  VkDescriptorSetLayoutCreateInfo dli = {0};
+  dli.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  dli.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
+  dli.bindingCount = 2;
+  dli.pBindings = bindings;
+
+  res = vkCreateDescriptorSetLayout(vk_dev->device, &dli, NULL, &vk_dev->compose_set_layout);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateDescriptorSetLayout failed: %d\n", res);
+    return false;
+  }
+
+  VkPushConstantRange push_range = {0};
+  push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_range.size = sizeof(struct vk_compose_blit);
+
+  VkPipelineLayoutCreateInfo pli = {0};
+  pli.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pli.setLayoutCount = 1;
+  pli.pSetLayouts = &vk_dev->compose_set_layout;
+  pli.pushConstantRangeCount = 1;
+  pli.pPushConstantRanges = &push_range;
+
+  res = vkCreatePipelineLayout(vk_dev->device, &pli, NULL, &vk_dev->compose_layout);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreatePipelineLayout failed: %d\n", res);
+    return false;
+  }
+
+  VkShaderModuleCreateInfo si = {0};
+  si.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  si.codeSize = sizeof(compose_comp_data);
+  si.pCode = compose_comp_data;
+
+  VkShaderModule module;
+  res = vkCreateShaderModule(vk_dev->device, &si, NULL, &module);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to create compute shader module");
+    return false;
+  }
+
+  VkComputePipelineCreateInfo pipe_info = {0};
+  pipe_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipe_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipe_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipe_info.stage.module = module;
+  pipe_info.stage.pName = "main";
+  pipe_info.layout = vk_dev->compose_layout;
+
+  res = vkCreateComputePipelines(vk_dev->device, vk_dev->pipeline_cache, 1, &pipe_info, NULL,
+    &vk_dev->compose_pipeline);
+
+  vkDestroyShaderModule(vk_dev->device, module, NULL);
+
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "failed to create compute pipeline: %d\n", res);
+    return false;
+  }
+
+  return true;
+}
+
+static void create_graphics_pipeline(struct vk_device *vk_dev)
+{
+  if (!create_pipeline_layout(vk_dev)) {
+    return;
+  }
+
+  vk_device_create_pipeline(vk_dev, vk_dev->pipeline_cache, &vk_dev->pipeline);
+}
+
+struct vk_device *vk_device_create(struct device *device, struct vk_probe *probe)
 {
   if (!device->fb_modifiers) {
     printf("Can't use vulkan since drm doesn't support modifiers\n");
     return NULL;
   }
 
+  // usually finished while KMS was probed
+  int stage = profiler_begin("vulkan probe wait");
+  bool probed = vk_probe_wait(probe);
+  profiler_end(stage);
+
+  if (!probed) {
+    fprintf(stderr, "No Vulkan physical devices available\n");
+    return NULL;
+  }
+
   struct vk_device *ret = calloc(1, sizeof(*ret));
   assert(ret);
 
-  create_instance(ret);
-  pick_physical_device(device, ret);
-  create_logical_device(ret);
+  ret->instance = probe->instance;
+
+  stage = profiler_begin("vulkan device");
+  // nothing works without the sync_file semaphores and dmabuf import
+  if (!pick_physical_device(device, probe, ret) || !create_logical_device(ret)) {
+    profiler_end(stage);
+    goto catch_instance;
+  }
+
+  ret->memory = vk_memory_create(ret);
   create_command_pool(ret);
+  ret->staging = vk_staging_create(ret);
   create_descriptor_pool(ret);
   create_render_pass(ret);
+  profiler_end(stage);
+
+  stage = profiler_begin("vulkan pipeline");
+  pipeline_cache_load(ret);
   create_graphics_pipeline(ret);
+  if (ret->compute_composition && !create_compose_pipeline(ret)) {
+    fprintf(stderr, "Falling back to blitting composited layers\n");
+    ret->compute_composition = false;
+  }
+  pipeline_cache_store(ret);
+  profiler_end(stage);
 
   return ret;
 
@@ -0,0 +1,410 @@
+#include "vk_memory.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vk_device.h"
+
+static VkDeviceSize slot_size(int size_class)
+{
+  return (VkDeviceSize)VK_MEMORY_MIN_SLOT_SIZE << (2 * size_class);
+}
+
+// smallest class whose slots hold the allocation at its alignment, -1 when
+// it needs memory of its own
+static int size_class_for(struct vk_memory *memory, const VkMemoryRequirements *reqs)
+{
+  VkDeviceSize needed = reqs->size;
+  if (reqs->alignment > needed) {
+    needed = reqs->alignment;
+  }
+  // slots start at multiples of their size, so buffers and optimally tiled
+  // images in neighbouring slots never share a granularity page
+  if (memory->buffer_image_granularity > needed) {
+    needed = memory->buffer_image_granularity;
+  }
+
+  for (int c = 0; c < VK_MEMORY_SIZE_CLASSES; c++) {
+    if (slot_size(c) >= needed) {
+      return c;
+    }
+  }
+
+  return -1;
+}
+
+static int find_memory_type(struct vk_memory *memory, uint32_t type_bits,
+  VkMemoryPropertyFlags flags)
+{
+  for (uint32_t i = 0; i < memory->props.memoryTypeCount; i++) {
+    if ((type_bits & (1u << i)) &&
+      (memory->props.memoryTypes[i].propertyFlags & flags) == flags)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static bool is_host_visible(struct vk_memory *memory, uint32_t memory_type)
+{
+  return memory->props.memoryTypes[memory_type].propertyFlags &
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+static bool allocate_memory(struct vk_memory *memory, VkDeviceSize size, uint32_t memory_type,
+  VkDeviceMemory *device_memory, void **mapped)
+{
+  VkDevice device = memory->vk_dev->device;
+
+  VkMemoryAllocateInfo info = {0};
+  info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  info.allocationSize = size;
+  info.memoryTypeIndex = memory_type;
+
+  VkResult res = vkAllocateMemory(device, &info, NULL, device_memory);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to allocate %llu bytes of device memory: %d\n",
+      (unsigned long long)size, res);
+    return false;
+  }
+
+  *mapped = NULL;
+  if (is_host_visible(memory, memory_type)) {
+    res = vkMapMemory(device, *device_memory, 0, VK_WHOLE_SIZE, 0, mapped);
+    if (res != VK_SUCCESS) {
+      fprintf(stderr, "Failed to map device memory: %d\n", res);
+      vkFreeMemory(device, *device_memory, NULL);
+      return false;
+    }
+  }
+
+  memory->stats.reserved += size;
+  return true;
+}
+
+static void free_memory(struct vk_memory *memory, VkDeviceSize size, VkDeviceMemory device_memory)
+{
+  // freeing memory unmaps it
+  vkFreeMemory(memory->vk_dev->device, device_memory, NULL);
+  memory->stats.reserved -= size;
+}
+
+static struct vk_memory_block *block_create(struct vk_memory *memory, uint32_t memory_type,
+  int size_class)
+{
+  struct vk_memory_block *ret = calloc(1, sizeof(*ret));
+  assert(ret);
+
+  if (!allocate_memory(memory, VK_MEMORY_BLOCK_SIZE, memory_type, &ret->memory, &ret->mapped)) {
+    free(ret);
+    return NULL;
+  }
+
+  ret->num_slots = VK_MEMORY_BLOCK_SIZE / slot_size(size_class);
+  memory->stats.blocks++;
+
+  return ret;
+}
+
+static int block_take_slot(struct vk_memory_block *block)
+{
+  for (uint32_t w = 0; w * 64 < block->num_slots; w++) {
+    if (block->used[w] == UINT64_MAX) {
+      continue;
+    }
+
+    int bit = __builtin_ctzll(~block->used[w]);
+    uint32_t slot = w * 64 + bit;
+    if (slot >= block->num_slots) {
+      break;
+    }
+
+    block->used[w] |= 1ull << bit;
+    block->num_used++;
+    return slot;
+  }
+
+  return -1;
+}
+
+struct vk_memory *vk_memory_create(struct vk_device *vk_dev)
+{
+  struct vk_memory *ret = calloc(1, sizeof(*ret));
+  assert(ret);
+
+  ret->vk_dev = vk_dev;
+  vkGetPhysicalDeviceMemoryProperties(vk_dev->physical_device, &ret->props);
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(vk_dev->physical_device, &props);
+  ret->buffer_image_granularity = props.limits.bufferImageGranularity;
+
+  return ret;
+}
+
+void vk_memory_destroy(struct vk_memory *memory)
+{
+  for (int t = 0; t < VK_MAX_MEMORY_TYPES; t++) {
+    for (int c = 0; c < VK_MEMORY_SIZE_CLASSES; c++) {
+      struct vk_memory_block *block = memory->blocks[t][c];
+      while (block) {
+        struct vk_memory_block *next = block->next;
+        assert(block->num_used == 0);
+        free_memory(memory, VK_MEMORY_BLOCK_SIZE, block->memory);
+        free(block);
+        block = next;
+      }
+    }
+  }
+
+  free(memory);
+}
+
+bool vk_memory_alloc(struct vk_memory *memory, const VkMemoryRequirements *reqs,
+  VkMemoryPropertyFlags flags, struct vk_allocation *allocation)
+{
+  memset(allocation, 0, sizeof(*allocation));
+
+  int memory_type = find_memory_type(memory, reqs->memoryTypeBits, flags);
+  if (memory_type < 0) {
+    fprintf(stderr, "No memory type with properties 0x%x\n", flags);
+    return false;
+  }
+
+  allocation->memory_type = memory_type;
+  allocation->size = reqs->size;
+  allocation->size_class = size_class_for(memory, reqs);
+
+  if (allocation->size_class < 0) {
+    if (!allocate_memory(memory, reqs->size, memory_type, &allocation->memory,
+      &allocation->mapped))
+    {
+      return false;
+    }
+
+    memory->stats.dedicated++;
+    memory->stats.allocations++;
+    memory->stats.allocated += reqs->size;
+    memory->stats.requested += reqs->size;
+    return true;
+  }
+
+  struct vk_memory_block **head = &memory->blocks[memory_type][allocation->size_class];
+
+  // blocks with free slots are kept at the front
+  struct vk_memory_block *block = *head;
+  if (!block || block->num_used == block->num_slots) {
+    block = block_create(memory, memory_type, allocation->size_class);
+    if (!block) {
+      return false;
+    }
+    block->next = *head;
+    *head = block;
+  }
+
+  int slot = block_take_slot(block);
+  assert(slot >= 0);
+
+  // a full block moves behind the ones that still have room
+  if (block->num_used == block->num_slots && block->next &&
+    block->next->num_used < block->next->num_slots)
+  {
+    *head = block->next;
+    struct vk_memory_block *tail = *head;
+    while (tail->next && tail->next->num_used < tail->next->num_slots) {
+      tail = tail->next;
+    }
+    block->next = tail->next;
+    tail->next = block;
+  }
+
+  VkDeviceSize size = slot_size(allocation->size_class);
+
+  allocation->block = block;
+  allocation->slot = slot;
+  allocation->memory = block->memory;
+  allocation->offset = slot * size;
+  allocation->mapped = block->mapped ? (char *)block->mapped + allocation->offset : NULL;
+
+  memory->stats.allocations++;
+  memory->stats.allocated += size;
+  memory->stats.requested += reqs->size;
+
+  return true;
+}
+
+void vk_memory_free(struct vk_memory *memory, struct vk_allocation *allocation)
+{
+  if (!allocation->memory) {
+    return;
+  }
+
+  memory->stats.allocations--;
+  memory->stats.requested -= allocation->size;
+
+  struct vk_memory_block *block = allocation->block;
+
+  if (!block) {
+    free_memory(memory, allocation->size, allocation->memory);
+    memory->stats.dedicated--;
+    memory->stats.allocated -= allocation->size;
+    memset(allocation, 0, sizeof(*allocation));
+    return;
+  }
+
+  memory->stats.allocated -= slot_size(allocation->size_class);
+
+  block->used[allocation->slot / 64] &= ~(1ull << (allocation->slot % 64));
+  block->num_used--;
+
+  struct vk_memory_block **head = &memory->blocks[allocation->memory_type][allocation->size_class];
+
+  // unlink it, then put it back at the front as it has room now, or drop it
+  // when empty and another block can take over
+  struct vk_memory_block **link = head;
+  while (*link != block) {
+    link = &(*link)->next;
+  }
+  *link = block->next;
+
+  if (block->num_used == 0 && *head) {
+    free_memory(memory, VK_MEMORY_BLOCK_SIZE, block->memory);
+    free(block);
+    memory->stats.blocks--;
+  } else {
+    block->next = *head;
+    *head = block;
+  }
+
+  memset(allocation, 0, sizeof(*allocation));
+}
+
+bool vk_memory_create_buffer(struct vk_memory *memory, VkDeviceSize size,
+  VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, VkBuffer *buffer,
+  struct vk_allocation *allocation)
+{
+  return vk_memory_create_shared_buffer(memory, size, usage, flags, NULL, 0,
+    buffer, allocation);
+}
+
+bool vk_memory_create_shared_buffer(struct vk_memory *memory, VkDeviceSize size,
+  VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, const uint32_t *queue_families,
+  uint32_t num_queue_families, VkBuffer *buffer, struct vk_allocation *allocation)
+{
+  VkDevice device = memory->vk_dev->device;
+
+  VkBufferCreateInfo info = {0};
+  info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  info.size = size;
+  info.usage = usage;
+
+  if (num_queue_families > 1) {
+    info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    info.queueFamilyIndexCount = num_queue_families;
+    info.pQueueFamilyIndices = queue_families;
+  } else {
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  }
+
+  VkResult res = vkCreateBuffer(device, &info, NULL, buffer);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to create buffer: %d\n", res);
+    return false;
+  }
+
+  VkMemoryRequirements reqs;
+  vkGetBufferMemoryRequirements(device, *buffer, &reqs);
+
+  if (!vk_memory_alloc(memory, &reqs, flags, allocation)) {
+    goto err_buffer;
+  }
+
+  res = vkBindBufferMemory(device, *buffer, allocation->memory, allocation->offset);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "Failed to bind buffer memory: %d\n", res);
+    goto err_memory;
+  }
+
+  return true;
+
+err_memory:
+  vk_memory_free(memory, allocation);
+
+err_buffer:
+  vkDestroyBuffer(device, *buffer, NULL);
+  *buffer = VK_NULL_HANDLE;
+  return false;
+}
+
+void vk_memory_destroy_buffer(struct vk_memory *memory, VkBuffer buffer,
+  struct vk_allocation *allocation)
+{
+  vkDestroyBuffer(memory->vk_dev->device, buffer, NULL);
+  vk_memory_free(memory, allocation);
+}
+
+bool vk_arena_init(struct vk_arena *arena, struct vk_memory *memory, VkDeviceSize size,
+  VkBufferUsageFlags usage)
+{
+  memset(arena, 0, sizeof(*arena));
+  arena->memory = memory;
+
+  arena->size = size;
+
+  // coherent, so writes need no flush before the submit reading them
+  return vk_memory_create_buffer(memory, size, usage,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    &arena->buffer, &arena->allocation);
+}
+
+void vk_arena_init_slice(struct vk_arena *arena, VkBuffer buffer,
+  const struct vk_allocation *allocation, VkDeviceSize base, VkDeviceSize size)
+{
+  memset(arena, 0, sizeof(*arena));
+  arena->buffer = buffer;
+  arena->allocation = *allocation;
+  arena->borrowed = true;
+  arena->base = base;
+  arena->size = size;
+}
+
+void vk_arena_finish(struct vk_arena *arena)
+{
+  if (arena->buffer && !arena->borrowed) {
+    vk_memory_destroy_buffer(arena->memory, arena->buffer, &arena->allocation);
+  }
+
+  memset(arena, 0, sizeof(*arena));
+}
+
+void vk_arena_reset(struct vk_arena *arena)
+{
+  arena->head = 0;
+}
+
+bool vk_arena_alloc(struct vk_arena *arena, VkDeviceSize size, VkDeviceSize alignment,
+  VkDeviceSize *offset, void **mapped)
+{
+  if (alignment == 0) {
+    alignment = 1;
+  }
+
+  VkDeviceSize start = (arena->head + alignment - 1) / alignment * alignment;
+  if (start + size > arena->size) {
+    return false;
+  }
+
+  arena->head = start + size;
+  if (arena->head > arena->high_water) {
+    arena->high_water = arena->head;
+  }
+
+  *offset = arena->base + start;
+  *mapped = (char *)arena->allocation.mapped + arena->base + start;
+
+  return true;
+}
@@ -0,0 +1,392 @@
+#include "vk_staging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vk_device.h"
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static bool create_batch(struct vk_staging *staging, struct vk_staging_batch *batch)
+{
+  VkDevice device = staging->vk_dev->device;
+  VkResult res;
+
+  VkCommandBufferAllocateInfo cbi = {0};
+  cbi.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cbi.commandPool = staging->transfer_command_pool;
+  cbi.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cbi.commandBufferCount = 1;
+
+  res = vkAllocateCommandBuffers(device, &cbi, &batch->copy_command_buffer);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkAllocateCommandBuffers failed: %d\n", res);
+    return false;
+  }
+
+  VkFenceCreateInfo fence_info = {0};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  res = vkCreateFence(device, &fence_info, NULL, &batch->fence);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateFence failed: %d\n", res);
+    return false;
+  }
+
+  if (!staging->separate_queue) {
+    return true;
+  }
+
+  cbi.commandPool = staging->graphics_command_pool;
+
+  res = vkAllocateCommandBuffers(device, &cbi, &batch->acquire_command_buffer);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkAllocateCommandBuffers failed: %d\n", res);
+    return false;
+  }
+
+  VkSemaphoreCreateInfo semaphore_info = {0};
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  res = vkCreateSemaphore(device, &semaphore_info, NULL, &batch->uploaded_semaphore);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateSemaphore failed: %d\n", res);
+    return false;
+  }
+
+  return true;
+}
+
+static bool create_command_pool(struct vk_staging *staging, uint32_t queue_family,
+  VkCommandPool *pool)
+{
+  VkCommandPoolCreateInfo cpi = {0};
+  cpi.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  // every batch is re-recorded from scratch each time it is reused
+  cpi.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+    VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  cpi.queueFamilyIndex = queue_family;
+
+  VkResult res = vkCreateCommandPool(staging->vk_dev->device, &cpi, NULL, pool);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateCommandPool failed for queue family %u: %d\n", queue_family, res);
+    return false;
+  }
+
+  return true;
+}
+
+struct vk_staging *vk_staging_create(struct vk_device *vk_dev)
+{
+  struct vk_staging *ret = calloc(1, sizeof(*ret));
+  assert(ret);
+
+  ret->vk_dev = vk_dev;
+  ret->separate_queue = vk_dev->transfer_queue_family != vk_dev->queue_family;
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(vk_dev->physical_device, &props);
+
+  // keeps the sources of copies on the alignment the driver copies fastest from
+  ret->alignment = props.limits.optimalBufferCopyOffsetAlignment;
+  if (ret->alignment < 16) {
+    ret->alignment = 16;
+  }
+
+  if (!vk_memory_create_buffer(vk_dev->memory, VK_STAGING_RING_SIZE,
+    VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    &ret->buffer, &ret->allocation))
+  {
+    goto err;
+  }
+
+  if (!create_command_pool(ret, vk_dev->transfer_queue_family, &ret->transfer_command_pool)) {
+    goto err;
+  }
+
+  if (ret->separate_queue &&
+    !create_command_pool(ret, vk_dev->queue_family, &ret->graphics_command_pool))
+  {
+    goto err;
+  }
+
+  for (int i = 0; i < VK_STAGING_BATCHES; i++) {
+    if (!create_batch(ret, &ret->batches[i])) {
+      goto err;
+    }
+  }
+
+  printf("Staging ring of %u KiB on queue family %u\n", VK_STAGING_RING_SIZE >> 10,
+    vk_dev->transfer_queue_family);
+
+  return ret;
+
+err:
+  vk_staging_destroy(ret);
+  return NULL;
+}
+
+void vk_staging_destroy(struct vk_staging *staging)
+{
+  VkDevice device = staging->vk_dev->device;
+
+  for (int i = 0; i < VK_STAGING_BATCHES; i++) {
+    struct vk_staging_batch *batch = &staging->batches[i];
+
+    if (batch->in_flight) {
+      vkWaitForFences(device, 1, &batch->fence, VK_TRUE, UINT64_MAX);
+    }
+
+    vkDestroySemaphore(device, batch->uploaded_semaphore, NULL);
+    vkDestroyFence(device, batch->fence, NULL);
+    free(batch->copies);
+  }
+
+  // destroying the pools frees their command buffers
+  vkDestroyCommandPool(device, staging->graphics_command_pool, NULL);
+  vkDestroyCommandPool(device, staging->transfer_command_pool, NULL);
+
+  if (staging->buffer) {
+    vk_memory_destroy_buffer(staging->vk_dev->memory, staging->buffer, &staging->allocation);
+  }
+
+  free(staging);
+}
+
+// hands ring space back from batches the GPU is done with. Batches are
+// submitted in order and complete in order, so this stops at the first one
+// still running.
+static void reclaim(struct vk_staging *staging)
+{
+  VkDevice device = staging->vk_dev->device;
+
+  for (int i = 1; i <= VK_STAGING_BATCHES; i++) {
+    struct vk_staging_batch *batch =
+      &staging->batches[(staging->current + i) % VK_STAGING_BATCHES];
+
+    if (!batch->in_flight) {
+      continue;
+    }
+
+    if (vkGetFenceStatus(device, batch->fence) != VK_SUCCESS) {
+      break;
+    }
+
+    vkResetFences(device, 1, &batch->fence);
+    batch->in_flight = false;
+    staging->tail = batch->end;
+  }
+}
+
+static struct vk_staging_copy *add_copy(struct vk_staging *staging, VkDeviceSize size,
+  VkDeviceSize *offset, void **mapped)
+{
+  reclaim(staging);
+
+  struct vk_staging_batch *batch = &staging->batches[staging->current];
+  if (batch->in_flight || size > VK_STAGING_RING_SIZE) {
+    goto err;
+  }
+
+  // allocations never wrap around the end of the ring
+  uint64_t start = align_up(staging->head, staging->alignment);
+  if (start % VK_STAGING_RING_SIZE + size > VK_STAGING_RING_SIZE) {
+    start = align_up(start, VK_STAGING_RING_SIZE);
+  }
+
+  if (start + size - staging->tail > VK_STAGING_RING_SIZE) {
+    goto err;
+  }
+
+  if (batch->num_copies == batch->max_copies) {
+    batch->max_copies = batch->max_copies ? batch->max_copies * 2 : 16;
+    batch->copies = realloc(batch->copies, batch->max_copies * sizeof(*batch->copies));
+    assert(batch->copies);
+  }
+
+  staging->head = start + size;
+
+  *offset = start % VK_STAGING_RING_SIZE;
+  *mapped = (char *)staging->allocation.mapped + *offset;
+
+  struct vk_staging_copy *copy = &batch->copies[batch->num_copies++];
+  memset(copy, 0, sizeof(*copy));
+
+  staging->stats.uploads++;
+  staging->stats.bytes += size;
+
+  return copy;
+
+err:
+  staging->stats.rejected++;
+  return NULL;
+}
+
+uint32_t vk_staging_queue_families(struct vk_staging *staging, uint32_t families[2])
+{
+  families[0] = staging->vk_dev->queue_family;
+  families[1] = staging->vk_dev->transfer_queue_family;
+
+  return staging->separate_queue ? 2 : 1;
+}
+
+void *vk_staging_map_buffer(struct vk_staging *staging, VkBuffer buffer,
+  VkDeviceSize offset, VkDeviceSize size)
+{
+  VkDeviceSize src_offset;
+  void *mapped;
+
+  struct vk_staging_copy *copy = add_copy(staging, size, &src_offset, &mapped);
+  if (!copy) {
+    return NULL;
+  }
+
+  copy->buffer = buffer;
+  copy->region.srcOffset = src_offset;
+  copy->region.dstOffset = offset;
+  copy->region.size = size;
+
+  return mapped;
+}
+
+bool vk_staging_upload_buffer(struct vk_staging *staging, VkBuffer buffer,
+  VkDeviceSize offset, const void *data, VkDeviceSize size)
+{
+  void *mapped = vk_staging_map_buffer(staging, buffer, offset, size);
+  if (!mapped) {
+    return false;
+  }
+
+  // the ring is coherent, nothing to flush before the copy runs
+  memcpy(mapped, data, size);
+
+  return true;
+}
+
+static void record_memory_barrier(VkCommandBuffer cb,
+  VkPipelineStageFlags src_stage, VkAccessFlags src_access,
+  VkPipelineStageFlags dst_stage, VkAccessFlags dst_access)
+{
+  VkMemoryBarrier barrier = {0};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = src_access;
+  barrier.dstAccessMask = dst_access;
+
+  vkCmdPipelineBarrier(cb, src_stage, dst_stage, 0, 1, &barrier, 0, NULL, 0, NULL);
+}
+
+static void begin(VkCommandBuffer cb)
+{
+  VkCommandBufferBeginInfo begin_info = {0};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  vkBeginCommandBuffer(cb, &begin_info);
+}
+
+// destinations are shared between the families, so no ownership moves, and
+// the work that last used them finished before they were handed to the ring
+static void record_batch(struct vk_staging *staging, struct vk_staging_batch *batch)
+{
+  VkCommandBuffer cb = batch->copy_command_buffer;
+
+  begin(cb);
+
+  for (int i = 0; i < batch->num_copies; i++) {
+    struct vk_staging_copy *copy = &batch->copies[i];
+    vkCmdCopyBuffer(cb, staging->buffer, copy->buffer, 1, &copy->region);
+  }
+
+  if (!staging->separate_queue) {
+    // a single queue orders the copies against the frames after them
+    record_memory_barrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT);
+  }
+
+  vkEndCommandBuffer(cb);
+
+  if (staging->separate_queue) {
+    // the semaphore made the copies visible to this submit, the barrier
+    // extends that to the graphics work submitted after it
+    begin(batch->acquire_command_buffer);
+    record_memory_barrier(batch->acquire_command_buffer,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT);
+    vkEndCommandBuffer(batch->acquire_command_buffer);
+  }
+}
+
+static bool submit(VkQueue queue, VkCommandBuffer cb, VkSemaphore wait,
+  VkPipelineStageFlags wait_stage, VkSemaphore signal, VkFence fence)
+{
+  VkSubmitInfo submit_info = {0};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &cb;
+
+  if (wait) {
+    submit_info.waitSemaphoreCount = 1;
+    submit_info.pWaitSemaphores = &wait;
+    submit_info.pWaitDstStageMask = &wait_stage;
+  }
+
+  if (signal) {
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &signal;
+  }
+
+  VkResult res = vkQueueSubmit(queue, 1, &submit_info, fence);
+  if (res != VK_SUCCESS) {
+    fprintf(stderr, "vkQueueSubmit failed for staging uploads: %d\n", res);
+    return false;
+  }
+
+  return true;
+}
+
+bool vk_staging_flush(struct vk_staging *staging)
+{
+  struct vk_device *vk_dev = staging->vk_dev;
+  struct vk_staging_batch *batch = &staging->batches[staging->current];
+
+  if (batch->num_copies == 0) {
+    return true;
+  }
+
+  record_batch(staging, batch);
+
+  bool submitted;
+
+  if (staging->separate_queue) {
+    // the copies run alongside the frames already queued, only the graphics
+    // work submitted after this waits for them
+    submitted =
+      submit(vk_dev->transfer_queue, batch->copy_command_buffer, VK_NULL_HANDLE, 0,
+        batch->uploaded_semaphore, VK_NULL_HANDLE) &&
+      submit(vk_dev->queue, batch->acquire_command_buffer, batch->uploaded_semaphore,
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_NULL_HANDLE, batch->fence);
+  } else {
+    // the transfer queue is the graphics queue here
+    submitted = submit(vk_dev->transfer_queue, batch->copy_command_buffer, VK_NULL_HANDLE, 0,
+      VK_NULL_HANDLE, batch->fence);
+  }
+
+  batch->num_copies = 0;
+
+  if (!submitted) {
+    return false;
+  }
+
+  batch->end = staging->head;
+  batch->in_flight = true;
+  staging->current = (staging->current + 1) % VK_STAGING_BATCHES;
+  staging->stats.batches++;
+
+  return true;
+}